@@ -1,9 +1,136 @@
+/* For MAP_ANONYMOUS, which strict C99 leaves out of <sys/mman.h> */
+#if !defined(_WIN32) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
 #include "mpc.h" // For parsing (-lm)
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <pthread.h> // For the thread pool and parallel loading (-lpthread)
+#include <unistd.h>
+#include <dlfcn.h> // For loading compiled libraries (-ldl)
+#include <ucontext.h> // For coroutines
+#include <sys/mman.h> // For their stacks
+#endif
 
 #ifdef _WIN32
 #include <string.h>
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <process.h>
+
+/* The part of pthreads used here, on Windows threads */
+typedef HANDLE pthread_t;
+typedef SRWLOCK pthread_mutex_t;
+typedef CONDITION_VARIABLE pthread_cond_t;
+typedef DWORD pthread_key_t;
+typedef INIT_ONCE pthread_once_t;
+
+#define PTHREAD_MUTEX_INITIALIZER SRWLOCK_INIT
+#define PTHREAD_COND_INITIALIZER CONDITION_VARIABLE_INIT
+#define PTHREAD_ONCE_INIT INIT_ONCE_STATIC_INIT
+
+static int pthread_mutex_init(pthread_mutex_t* m, void* attr) {
+  InitializeSRWLock(m);
+  return 0;
+}
+static int pthread_mutex_destroy(pthread_mutex_t* m) { return 0; }
+static int pthread_mutex_lock(pthread_mutex_t* m) {
+  AcquireSRWLockExclusive(m);
+  return 0;
+}
+static int pthread_mutex_unlock(pthread_mutex_t* m) {
+  ReleaseSRWLockExclusive(m);
+  return 0;
+}
+
+static int pthread_cond_init(pthread_cond_t* c, void* attr) {
+  InitializeConditionVariable(c);
+  return 0;
+}
+static int pthread_cond_destroy(pthread_cond_t* c) { return 0; }
+static int pthread_cond_wait(pthread_cond_t* c, pthread_mutex_t* m) {
+  SleepConditionVariableSRW(c, m, INFINITE, 0);
+  return 0;
+}
+static int pthread_cond_signal(pthread_cond_t* c) {
+  WakeConditionVariable(c);
+  return 0;
+}
+static int pthread_cond_broadcast(pthread_cond_t* c) {
+  WakeAllConditionVariable(c);
+  return 0;
+}
+
+typedef struct {
+  void* (*run)(void*);
+  void* arg;
+} pthread_start;
+
+static DWORD WINAPI pthread_main(LPVOID arg) {
+  pthread_start s = *(pthread_start*) arg;
+  free(arg);
+  s.run(s.arg);
+  return 0;
+}
+
+/* With as much stack as threads get elsewhere */
+static int pthread_create(pthread_t* t, void* attr, void* (*run)(void*), void* arg) {
+  pthread_start* s = malloc(sizeof(pthread_start));
+  s->run = run;
+  s->arg = arg;
+  *t = CreateThread(NULL, 8 << 20, pthread_main, s,
+    STACK_SIZE_PARAM_IS_A_RESERVATION, NULL);
+  if (*t == NULL) {
+    free(s);
+    return -1;
+  }
+  return 0;
+}
+static int pthread_join(pthread_t t, void** result) {
+  WaitForSingleObject(t, INFINITE);
+  CloseHandle(t);
+  return 0;
+}
+static int pthread_detach(pthread_t t) {
+  CloseHandle(t);
+  return 0;
+}
+
+/* Destructors are not run: what a thread keeps is left when it exits */
+static int pthread_key_create(pthread_key_t* k, void (*del)(void*)) {
+  *k = TlsAlloc();
+  return *k == TLS_OUT_OF_INDEXES ? -1 : 0;
+}
+static void* pthread_getspecific(pthread_key_t k) { return TlsGetValue(k); }
+static int pthread_setspecific(pthread_key_t k, const void* v) {
+  TlsSetValue(k, (LPVOID) v);
+  return 0;
+}
+
+static BOOL CALLBACK pthread_once_run(PINIT_ONCE o, PVOID f, PVOID* ctx) {
+  ((void (*)(void)) f)();
+  return TRUE;
+}
+static int pthread_once(pthread_once_t* o, void (*f)(void)) {
+  InitOnceExecuteOnce(o, pthread_once_run, (PVOID) f, NULL);
+  return 0;
+}
+
+#define _SC_NPROCESSORS_ONLN 0
+
+static long sysconf(int name) {
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors;
+}
+
+#define getpid _getpid
 
 static char buffer[2048];
 
@@ -27,15 +154,6 @@ void add_history(char* unused) {}
 #endif
 
 /* Forward Declaration */
-/* parser pointers */
-mpc_parser_t* Number;
-mpc_parser_t* Symbol;
-mpc_parser_t* Sexpr;
-mpc_parser_t* Qexpr;
-mpc_parser_t* Expr;
-mpc_parser_t* Lispy;
-mpc_parser_t* String;
-mpc_parser_t* Comment;
 /* structure for storing different lisp value types */
 struct lval;
 /* structure which stores the name and value of everything named in our program */
@@ -43,33 +161,198 @@ struct lenv;
 typedef struct lval lval;
 typedef struct lenv lenv;	
 
+/* An interpreter: its parsers, its global environment and how it loads files.
+     Everything else an interpreter changes as it runs belongs to its values, 
+     so any number can run at once, each on its own thread (see linterp_new) */
+typedef struct {
+  /* parser pointers */
+  mpc_parser_t* Number;
+  mpc_parser_t* Symbol;
+  mpc_parser_t* Sexpr;
+  mpc_parser_t* Qexpr;
+  mpc_parser_t* Expr;
+  mpc_parser_t* Lispy;
+  mpc_parser_t* String;
+  mpc_parser_t* Comment;
+  mpc_parser_t* Form;
+  
+  lenv* env;
+  /* If set, load evaluates each top-level expression as soon as it is read */
+  int load_streaming;
+  /* If set, load keeps a parsed copy of each file it reads next to the file */
+  int load_caching;
+  /* Source of fresh names for symbols local to a macro expansion */
+  uint64_t macro_names;
+  /* Constants of the compiled libraries loaded, made for this interpreter
+       alone (see lnative_consts) */
+  int native_count;
+  struct lnative* natives;
+  /* Of the global environment, shared by futures (see lenv_view_snapshot) */
+  lenv* snapshot;
+} linterp;
+
 /* Lisp Value */
 /* Enum for possible lval types */
-enum { LVAL_NUM, LVAL_DOUBLE, LVAL_ERR, LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR, LVAL_FUN, LVAL_STR };
+enum { LVAL_NUM, LVAL_DOUBLE, LVAL_ERR, LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR, LVAL_FUN, LVAL_STR, 
+  LVAL_FUTURE, LVAL_CORO, LVAL_CHAN };
 
 /* New function pointer type declaration lbuiltin.
     To get an lval*, we dereference lbuiltin and call with lenv* and lval* */
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
-struct lval {
-  int type;
-  
-  double num;
-  /* Error Symbol and String types have some string data; will need to free */
-  char* err;
-  char* sym;
-  char* str;
-  
-  /* If type LVAL_FUN, holding function. If user-defined, NULL*/
-  lbuiltin builtin; 
+/* Body of a user-defined function compiled ahead of time to C (see lcomp_file),
+     run in place of evaluating the body in the environment its arguments are
+     bound in, with the constants of its library */
+typedef lval*(*lcode)(lenv*, lval**);
+
+/* Inline cache for a symbol in source. Copies of the symbol (a function body
+     is copied every call) share the one cache, which remembers the slot of the
+     global environment the symbol resolved to. Bindings keep their slots for
+     as long as the environment lives, and a slot is read afresh on every use,
+     so the cache holds until the environment is replaced; its id tells it
+     from a later one at the same address */
+typedef struct {
+  int refs;
+  uint64_t bit;     /* the symbol's bit in an environment's mask */
   lenv* env;
-  /* Formal arguements and function body if user-defined function */
-  lval* formals;
+  uint64_t id;
+  int index;
+  /* Pure builtin the symbol was resolved to when its function was defined,
+       valid while lpure_epoch is unchanged */
+  lbuiltin builtin;
+  uint64_t epoch;
+} lsite;
+
+/* Result of a memoised function for one list of arguments. Entries are chained
+     per bucket, and listed from oldest to newest for eviction */
+typedef struct lmemo_entry {
+  uint64_t hash;
+  lval* args;
+  lval* result;
+  struct lmemo_entry* next;
+  struct lmemo_entry* older;
+  struct lmemo_entry* newer;
+} lmemo_entry;
+
+/* Which result a full cache drops: least recently used, or oldest */
+enum { LMEMO_LRU, LMEMO_FIFO };
+
+/* Result cache shared by a memoised function and all its copies */
+typedef struct {
+  int refs;
+  int policy;
+  long limit;       /* most results kept, 0 for no limit */
+  long count;
+  long hits;
+  long misses;
+  size_t size;      /* buckets, a power of two */
+  lmemo_entry** table;
+  lmemo_entry* oldest;
+  lmemo_entry* newest;
+} lmemo;
+
+/* User-defined function given fewer arguments than it takes. The arguments are
+     held until there are enough, then bound and the function called in one go,
+     so currying costs no copy of the function. Copies share it */
+typedef struct {
+  int refs;
+  lval* fn;
+  int count;
+  lval** args;
+} lpart;
+
+/* Value of an expression being evaluated on the thread pool (see spawn). 
+     Shared by copies, which may be on any thread */
+typedef struct lfuture lfuture;
+
+/* Evaluation that can be suspended part way and resumed later, on a stack of 
+     its own (see resume). Shared by copies */
+typedef struct lcoro lcoro;
+
+/* Bounded queue of values between threads (see send and recv). Shared by 
+     copies, which may be on any thread */
+typedef struct lchan lchan;
+
+/* One step of threaded code: what to do, where its handler is when handlers
+     are jumped to directly, and its operands */
+typedef struct {
+  void* label;
+  int op;
+  int a;
+  int b;
+} lop;
+
+/* Body of a user-defined function compiled to threaded code, once it has been
+     called a few times (see lprog_compile). Shared by the function and its
+     copies, which once it is compiled share the body it holds too rather than
+     copying their own */
+typedef struct {
+  int refs;
+  int calls;
   lval* body;
-  
-  /* Count and Pointer to a list of lval* */
   int count;
-  lval** cell;
+  lop* ops;
+  int nconsts;
+  lval** consts;
+  int depth;         /* most values on the stack at once */
+  uint64_t epoch;    /* lpure_epoch it was compiled under */
+} lprog;
+
+/* Calls before a function's body is compiled */
+#define LPROG_CALLS 2
+
+struct lval {
+  int type;
+  
+  /* What a value holds depends on its type, so only the fields of its own 
+       type are ever set or read */
+  union {
+    double num;
+    /* Error Symbol and String types have some string data; will need to free */
+    char* err;
+    struct {
+      char* sym;
+      /* Shared lookup cache, created on first copy */
+      lsite* site;
+    };
+    char* str;
+    
+    struct {
+      /* If type LVAL_FUN, holding function. If user-defined, NULL*/
+      lbuiltin builtin; 
+      lenv* env;
+      /* Formal arguements and function body if user-defined function */
+      lval* formals;
+      lval* body;
+      /* User-defined only; the body compiled, else NULL, and the constants it 
+           was made with */
+      lcode code;
+      lval** consts;
+      /* User-defined only; the body as threaded code, once compiled */
+      lprog* prog;
+      /* User-defined only; results cache if memoised, else NULL */
+      lmemo* memo;
+      /* If a partial application, the function and arguments (and none of the
+           above), else NULL */
+      lpart* part;
+    };
+    /* If type LVAL_FUTURE, the evaluation */
+    lfuture* future;
+    /* If type LVAL_CORO, the coroutine */
+    lcoro* coro;
+    /* If type LVAL_CHAN, the channel */
+    lchan* chan;
+    
+    struct {
+      /* Count and Pointer to a list of lval* */
+      int count;
+      lval** cell;
+      /* Value worked out when the enclosing function was defined, valid while 
+           lpure_epoch is unchanged */
+      lval* folded;
+      uint64_t epoch;
+    };
+  };
 };
 
 struct lenv {
@@ -77,28 +360,173 @@ struct lenv {
   int count;
   char** syms;
   lval** vals;
+  /* Union of the bits of every symbol bound here, so most environments in a
+       chain can be passed over without comparing names */
+  uint64_t mask;
+  /* Used by no other environment, ever */
+  uint64_t id;
+  /* Binds the name of a pure builtin to something else */
+  int rebinds;
+  /* This or an environment above it, short of the global one, rebinds. Pure 
+       names looked up from here are then looked up like any other */
+  int shadows;
+  /* Global environment only; the interpreter it belongs to */
+  linterp* interp;
+  /* Global environment only; if a thread's view of another, that one. Its 
+       bindings are read from there, never written, and cloned in here as 
+       they are first looked up (see lenv_view) */
+  lenv* shared;
+  /* Snapshots of a global environment only (see lenv_view_snapshot); the 
+       views reading it, and the interpreter while it is current. Else 0 */
+  uint64_t refs;
+  /* Holds only a loop's variable (see lenv_loop) */
+  int loop;
+};
+
+/* Next value of a counter shared by every interpreter */
+uint64_t lcount_next(uint64_t* n) {
+#ifdef __GNUC__
+  return __atomic_add_fetch(n, 1, __ATOMIC_RELAXED);
+#else
+  return ++*n;
+#endif
+}
+
+/* Current value of a shared counter */
+uint64_t lcount_get(uint64_t* n) {
+#ifdef __GNUC__
+  return __atomic_load_n(n, __ATOMIC_RELAXED);
+#else
+  return *n;
+#endif
+}
+
+uint64_t latomic_load(uint64_t* n) {
+#ifdef __GNUC__
+  return __atomic_load_n(n, __ATOMIC_ACQUIRE);
+#else
+  return *n;
+#endif
+}
+
+void latomic_store(uint64_t* n, uint64_t x) {
+#ifdef __GNUC__
+  __atomic_store_n(n, x, __ATOMIC_RELEASE);
+#else
+  *n = x;
+#endif
+}
+
+/* Add x to n, returning the result. Ordered with every other such addition */
+uint64_t latomic_add(uint64_t* n, uint64_t x) {
+#ifdef __GNUC__
+  return __atomic_add_fetch(n, x, __ATOMIC_SEQ_CST);
+#else
+  return *n += x;
+#endif
+}
+
+/* Set n to x if it holds *expect, else put what it holds in *expect */
+int latomic_cas(uint64_t* n, uint64_t* expect, uint64_t x) {
+#ifdef __GNUC__
+  return __atomic_compare_exchange_n(n, expect, x, 0,
+    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#else
+  if (*n != *expect) { *expect = *n; return 0; }
+  *n = x;
+  return 1;
+#endif
+}
+
+/* Source of environment ids. Shared, so that no two environments anywhere 
+     have the same id and a lookup cache can never mistake one for another */
+uint64_t lenv_ids = 0;
+
+/* Bit standing for a symbol in environment masks */
+uint64_t lsym_bit(char* s) {
+  uint64_t h = 14695981039346656037ULL;
+  while (*s) { h = (h ^ (unsigned char)*s++) * 1099511628211ULL; }
+  return 1ULL << (h >> 58);
+}
+
+/* Builtins without side effects, which a function's body may have resolved and
+     applied to literals ahead of time when it was defined (see lval_fold) */
+lval* builtin_add(lenv* e, lval* a);
+lval* builtin_sub(lenv* e, lval* a);
+lval* builtin_mul(lenv* e, lval* a);
+lval* builtin_div(lenv* e, lval* a);
+lval* builtin_mod(lenv* e, lval* a);
+lval* builtin_max(lenv* e, lval* a);
+lval* builtin_min(lenv* e, lval* a);
+lval* builtin_eq(lenv* e, lval* a);
+lval* builtin_ne(lenv* e, lval* a);
+lval* builtin_gt(lenv* e, lval* a);
+lval* builtin_lt(lenv* e, lval* a);
+lval* builtin_ge(lenv* e, lval* a);
+lval* builtin_le(lenv* e, lval* a);
+
+#define LPURE_NUM 13
+struct { char* name; lbuiltin func; } lpure[LPURE_NUM] = {
+  { "+", builtin_add }, { "-", builtin_sub }, { "*", builtin_mul },
+  { "/", builtin_div }, { "%", builtin_mod },
+  { "max", builtin_max }, { "min", builtin_min },
+  { "==", builtin_eq }, { "!=", builtin_ne },
+  { ">", builtin_gt }, { "<", builtin_lt }, { ">=", builtin_ge }, { "<=", builtin_le }
 };
 
+/* Union of the bits of their names */
+uint64_t lpure_mask = 0;
+/* Bumped whenever any of the names is bound to anything else in a global 
+     environment, which invalidates everything resolved or folded before. 
+     Shared too; a rebinding in one interpreter costs the others their 
+     folding, but nothing more. Bindings anywhere else only mark the chains 
+     they are in (see shadows) */
+uint64_t lpure_epoch = 0;
+
+void lpure_init(void) {
+  for (int i = 0; i < LPURE_NUM; i++) { lpure_mask |= lsym_bit(lpure[i].name); }
+}
+
+/* Index of a pure builtin's name, or -1 */
+int lpure_find(char* sym, uint64_t bit) {
+  if (!(bit & lpure_mask)) { return -1; }
+  for (int i = 0; i < LPURE_NUM; i++) {
+    if (strcmp(lpure[i].name, sym) == 0) { return i; }
+  }
+  return -1;
+}
+
+/* True if binding sym to v takes the name from its pure builtin */
+int lpure_rebinds(char* sym, uint64_t bit, lval* v) {
+  int i = lpure_find(sym, bit);
+  return i != -1 && !(v->type == LVAL_FUN && v->builtin == lpure[i].func);
+}
+
+/* A new lval of a type, with every field of the type cleared for the 
+     constructor to fill in */
+lval* lval_new(int type) {
+  lval* v = calloc(1, sizeof(lval));
+  v->type = type;
+  return v;
+}
+
 /* Construct a pointer to a new Number lval */
 lval* lval_num(long x) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_NUM;
+  lval* v = lval_new(LVAL_NUM);
   v->num = x;
   return v;
 }
 
 /* Construct a pointer to a new Double lval */
 lval* lval_double(double x) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_DOUBLE;
+  lval* v = lval_new(LVAL_DOUBLE);
   v->num = x;
   return v;
 }
 
 /*Construct a pointer to a new Error lval */
 lval* lval_err(char* m, ...) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_ERR;
+  lval* v = lval_new(LVAL_ERR);
   
   /* Create a va_list and initialize with va_start */
   va_list va;
@@ -121,81 +549,135 @@ lval* lval_err(char* m, ...) {
 
 /*Construct a pointer to a new Symbol lval */
 lval* lval_sym(char* s) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SYM;
+  lval* v = lval_new(LVAL_SYM);
   v->sym = malloc(strlen(s) + 1);
   strcpy(v->sym, s);
+  v->site = NULL;
   return v;
 }
 
 /* Construct a pointer to a new empty Sexpr lval */
 lval* lval_sexpr(void) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SEXPR;
+  lval* v = lval_new(LVAL_SEXPR);
   v->count = 0;
   v->cell = NULL;
+  v->folded = NULL;
   return v;
 }
 
 /* Construct a pointer to a new empty Qexpr lval */
 lval* lval_qexpr(void) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_QEXPR;
+  lval* v = lval_new(LVAL_QEXPR);
   v->count = 0;
   v->cell = NULL;
+  v->folded = NULL;
   return v;
 }
 
 /* Construct a pointer to a new function lval */
 lval* lval_fun(lbuiltin func) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
+  lval* v = lval_new(LVAL_FUN);
   v->builtin = func;
+  v->memo = NULL;
+  v->part = NULL;
   return v;
 }
 
 /* Construct a pointer to a new String lval */
 lval* lval_str(char* s) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_STR;
+  lval* v = lval_new(LVAL_STR);
   v->str = malloc(strlen(s) + 1);
   strcpy(v->str, s);
   return v;
 }
 
 lenv* lenv_new(void);
+lprog* lprog_new(void);
 
 /* Construct a pointer to a new user-defined function lval */
 lval* lval_lambda(lval* formals, lval* body) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
+  lval* v = lval_new(LVAL_FUN);
   v->builtin = NULL;
   
   /* Each function has its own environment */
   v->env = lenv_new();
   v->formals = formals;
   v->body = body;
+  v->code = NULL;
+  v->consts = NULL;
+  v->prog = lprog_new();
+  v->memo = NULL;
+  v->part = NULL;
+  return v;
+}
+
+/* Construct a partial application of f to the arguments in a, taking both */
+lval* lval_part(lval* f, lval* a) {
+  lval* v = lval_new(LVAL_FUN);
+  v->builtin = NULL;
+  v->memo = NULL;
+  v->part = malloc(sizeof(lpart));
+  v->part->refs = 1;
+  v->part->fn = f;
+  v->part->count = a->count;
+  v->part->args = a->cell;
+  a->count = 0;
+  a->cell = NULL;
+  free(a);
   return v;
 }
 
 lenv* lenv_copy(lenv* e);
+void lfuture_retain(lfuture* f);
+void lcoro_retain(lcoro* c);
+void lchan_retain(lchan* c);
+
+/* The lookup cache of a symbol, created on first use */
+lsite* lval_site(lval* v) {
+  if (v->site == NULL) {
+    v->site = calloc(1, sizeof(lsite));
+    v->site->refs = 1;
+    v->site->bit = lsym_bit(v->sym);
+  }
+  return v->site;
+}
 
 /* Copy and return an lval */
 lval* lval_copy(lval* v) {
-  lval* x = malloc(sizeof(lval));
-  x->type = v->type;
+  lval* x = lval_new(v->type);
   
   switch (v->type) {
     case LVAL_NUM: 
     case LVAL_DOUBLE: x->num = v->num; break;
     case LVAL_FUN: 
+      x->part = NULL;
       if(v->builtin) {
         x->builtin = v->builtin; 
+        x->memo = NULL;
+      } else if (v->part) {
+        x->builtin = NULL;
+        x->memo = NULL;
+        x->part = v->part;
+        x->part->refs++;
       } else {
         x->builtin = NULL;
         x->env = lenv_copy(v->env);
         x->formals = lval_copy(v->formals);
-        x->body = lval_copy(v->body);
+        /* A compiled body is never run, so copies can share it */
+        if (v->code) {
+          x->body = v->body;
+        } else if (v->prog->ops) {
+          x->body = v->prog->body;
+        } else {
+          x->body = lval_copy(v->body);
+        }
+        x->code = v->code;
+        x->consts = v->consts;
+        x->prog = v->prog;
+        x->prog->refs++;
+        /* Copies share the cache, so recursive calls through a name use it */
+        x->memo = v->memo;
+        if (x->memo) { x->memo->refs++; }
       }
       break;
     case LVAL_ERR:
@@ -205,11 +687,26 @@ lval* lval_copy(lval* v) {
     case LVAL_SYM:
       x->sym = malloc(strlen(v->sym)+1);
       strcpy(x->sym, v->sym);
+      /* Share the lookup cache between the original and its copies */
+      x->site = lval_site(v);
+      x->site->refs++;
       break;
     case LVAL_STR:
       x->str = malloc(strlen(v->str)+1);
       strcpy(x->str, v->str);
       break;
+    case LVAL_FUTURE:
+      x->future = v->future;
+      lfuture_retain(x->future);
+      break;
+    case LVAL_CORO:
+      x->coro = v->coro;
+      lcoro_retain(x->coro);
+      break;
+    case LVAL_CHAN:
+      x->chan = v->chan;
+      lchan_retain(x->chan);
+      break;
     case LVAL_QEXPR:
     case LVAL_SEXPR:
       x->count = v->count;
@@ -217,6 +714,8 @@ lval* lval_copy(lval* v) {
       for (int i = 0; i < x->count; i++) {
         x->cell[i] = lval_copy(v->cell[i]);
       }
+      x->folded = v->folded ? lval_copy(v->folded) : NULL;
+      x->epoch = v->epoch;
       break;
   }
   
@@ -228,6 +727,14 @@ lenv* lenv_copy(lenv* e) {
   lenv* n = malloc(sizeof(lenv));
   n->par = e->par;
   n->count = e->count;
+  n->mask = e->mask;
+  n->id = lcount_next(&lenv_ids);
+  n->rebinds = e->rebinds;
+  n->shadows = e->shadows;
+  n->interp = NULL;
+  n->shared = NULL;
+  n->refs = 0;
+  n->loop = e->loop;
   n->syms = malloc(sizeof(char*) * n->count);
   n->vals = malloc(sizeof(lval*) * n->count);
   for (int i = 0; i < e->count; i++) {
@@ -239,6 +746,12 @@ lenv* lenv_copy(lenv* e) {
 }
 
 void lenv_del(lenv* e);
+void lmemo_del(lmemo* m);
+void lpart_del(lpart* p);
+void lprog_del(lprog* p);
+void lfuture_release(lfuture* f);
+void lcoro_release(lcoro* c);
+void lchan_release(lchan* c);
 
 /* Deleting (freeing) an lval */
 void lval_del(lval* v) {
@@ -249,16 +762,27 @@ void lval_del(lval* v) {
     case LVAL_DOUBLE: break;
     case LVAL_FUN: 
       /* If it is user-defined */
-      if(!v->builtin) {
+      if (v->part) {
+        lpart_del(v->part);
+      } else if(!v->builtin) {
         lenv_del(v->env);
         lval_del(v->formals);
-        lval_del(v->body);
+        /* Taken when it was called, or shared if compiled */
+        if (v->body && !v->code && v->body != v->prog->body) { lval_del(v->body); }
+        lprog_del(v->prog);
+        if (v->memo) { lmemo_del(v->memo); }
       }
       break;
     /* For Err of Sym free the string data */
     case LVAL_ERR: free(v->err); break;
-    case LVAL_SYM: free(v->sym); break;
+    case LVAL_SYM:
+      free(v->sym);
+      if (v->site && --v->site->refs == 0) { free(v->site); }
+      break;
     case LVAL_STR: free(v->str); break;
+    case LVAL_FUTURE: lfuture_release(v->future); break;
+    case LVAL_CORO: lcoro_release(v->coro); break;
+    case LVAL_CHAN: lchan_release(v->chan); break;
     
     /* If Qexpr/Sexpr then delete all elements inside cell */
     case LVAL_QEXPR:
@@ -268,6 +792,7 @@ void lval_del(lval* v) {
       }
       /* Also free the memory allocated to cell itself */
       free(v->cell);
+      if (v->folded) { lval_del(v->folded); }
     break;
   }
   
@@ -282,39 +807,110 @@ lenv* lenv_new(void) {
   e->count = 0;
   e->syms = NULL;
   e->vals = NULL;
+  e->mask = 0;
+  e->id = lcount_next(&lenv_ids);
+  e->rebinds = 0;
+  e->shadows = 0;
+  e->interp = NULL;
+  e->shared = NULL;
+  e->refs = 0;
+  e->loop = 0;
   return e;
 }
 
+void lenv_release(lenv* s);
+
 /* Deletes an environment */
 void lenv_del(lenv* e) {
   for (int i = 0; i < e->count; i++) {
     free(e->syms[i]);
     lval_del(e->vals[i]);
   }
+  if (e->shared && latomic_load(&e->shared->refs)) { lenv_release(e->shared); }
   free(e->syms);
   free(e->vals);
   free(e);
 }
 
+/* Let go of a snapshot, deleting it once nothing holds it */
+void lenv_release(lenv* s) {
+  if (latomic_add(&s->refs, -1) == 0) { lenv_del(s); }
+}
+
+lval* lval_clone(lval* v);
+
+/* Binding of sym in the environment a view is of, cloned into the view so it is
+     found there from then on */
+lval* lenv_get_shared(lenv* e, char* sym, uint64_t bit) {
+  lenv* s = e->shared;
+  if (s->mask & bit) {
+    for (int i = 0; i < s->count; i++) {
+      if (strcmp(s->syms[i], sym) != 0) { continue; }
+      /* Bound as it is there; the epoch was bumped when it was */
+      e->count++;
+      e->syms = realloc(e->syms, sizeof(char*) * e->count);
+      e->vals = realloc(e->vals, sizeof(lval*) * e->count);
+      e->syms[e->count-1] = malloc(strlen(sym) + 1);
+      strcpy(e->syms[e->count-1], sym);
+      e->vals[e->count-1] = lval_clone(s->vals[i]);
+      e->mask |= bit;
+      e->rebinds |= lpure_rebinds(sym, bit, e->vals[e->count-1]);
+      return lval_copy(e->vals[e->count-1]);
+    }
+  }
+  return lval_err("Unbound Symbol '%s'", sym);
+}
+
 lval* lenv_get(lenv* e, lval* k) {
-  /* Iterate over all items of the environment */
+  lsite* site = k->site;
+  uint64_t bit = site ? site->bit : lsym_bit(k->sym);
+  
+  /* Resolved to a pure builtin when its function was defined */
+  if (site && site->builtin && site->epoch == lcount_get(&lpure_epoch) && !e->shadows) {
+    return lval_fun(site->builtin);
+  }
+  
+  /* Check each environment up to the global one */
+  for (; e->par; e = e->par) {
+    if (!(e->mask & bit)) { continue; }
+    for (int i = 0; i < e->count; i++) {
+      if (strcmp(e->syms[i], k->sym) == 0) {
+        return lval_copy(e->vals[i]);
+      }
+    }
+  }
+  
+  /* Global environment; use the cached slot if it is still the same one */
+  if (site && site->env == e && site->id == e->id) {
+    return lval_copy(e->vals[site->index]);
+  }
   for (int i = 0; i < e->count; i++) {
-    /* Check if symbols match and return if so */
     if (strcmp(e->syms[i], k->sym) == 0) {
+      if (site) {
+        site->env = e;
+        site->id = e->id;
+        site->index = i;
+      }
       return lval_copy(e->vals[i]);
     }
   }
-  
-  /* Check parent for symbol */
-  if (e->par) {
-    return lenv_get(e->par, k);
-  } else {
-    return lval_err("Unbound Symbol '%s'", k->sym);
-  }
+  if (e->shared) { return lenv_get_shared(e, k->sym, bit); }
+  return lval_err("Unbound Symbol '%s'", k->sym);
 }
 
 /* Replace an existing value or put a new value into the local environment */
 void lenv_put(lenv* e, lval* k, lval* v) {
+  /* Futures spawned from now on see the change */
+  if (e->interp && e->interp->env == e && e->interp->snapshot) {
+    lenv_release(e->interp->snapshot);
+    e->interp->snapshot = NULL;
+  }
+  uint64_t bit = lsym_bit(k->sym);
+  e->mask |= bit;
+  if (lpure_rebinds(k->sym, bit, v)) {
+    e->rebinds = 1;
+    if (e->interp) { lcount_next(&lpure_epoch); } else { e->shadows = 1; }
+  }
   /* Iterate over all items of the environment */
   for (int i = 0; i < e->count; i++) {
     /* If symbols matches replace lval */
@@ -344,8 +940,28 @@ void lenv_def(lenv* e, lval* k, lval* v) {
   lenv_put(e, k, v);
 }
 
+/* Environment '=' binds k in from e: past those of loops, unless it is the 
+     variable of one, so a loop body updates the locals around the loop */
+lenv* lenv_local(lenv* e, lval* k) {
+  for (; e->loop; e = e->par) {
+    for (int i = 0; i < e->count; i++) {
+      if (strcmp(e->syms[i], k->sym) == 0) { return e; }
+    }
+  }
+  return e;
+}
+
 /* Add to the expression in the Sexpr expression list */
+/* Drop a value folded from an expression that is being changed */
+void lval_unfold(lval* v) {
+  if (v->folded) {
+    lval_del(v->folded);
+    v->folded = NULL;
+  }
+}
+
 lval* lval_add(lval* v, lval* x) {
+  lval_unfold(v);
   v->count++;
   v->cell = realloc(v->cell, sizeof(lval*) * v->count);
   v->cell[v->count-1] = x;
@@ -356,6 +972,7 @@ lval* lval_add(lval* v, lval* x) {
 lval* lval_pop(lval* v, int i) {
   /* Find the item at i */
   lval* x = v->cell[i];
+  lval_unfold(v);
   
   /* Shift memory after the item at i over the top */
   memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
@@ -414,11 +1031,25 @@ void lval_print(lval* v) {
     case LVAL_ERR:	printf("Error: %s", v->err); break;
     case LVAL_SYM:	printf("%s", v->sym); break;
     case LVAL_STR:	lval_print_str(v); break;
+    case LVAL_FUTURE:	printf("<future>"); break;
+    case LVAL_CORO:	printf("<coroutine>"); break;
+    case LVAL_CHAN:	printf("<channel>"); break;
     case LVAL_SEXPR:	lval_expr_print(v, '(', ')'); break;
     case LVAL_QEXPR:	lval_expr_print(v, '{', '}'); break;
     case LVAL_FUN:
       if (v->builtin) {
         printf("<function>"); 
+      } else if (v->part) {
+        /* As the function with the formals still to be given */
+        lval* fn = v->part->fn;
+        printf("(\\ {");
+        for (int i = v->part->count; i < fn->formals->count; i++) {
+          lval_print(fn->formals->cell[i]);
+          if (i != fn->formals->count-1) { putchar(' '); }
+        }
+        printf("} ");
+        lval_print(fn->body);
+        putchar(')');
       } else {
         printf("(\\ ");
         lval_print(v->formals);
@@ -442,14 +1073,29 @@ char* ltype_name(int t);
 
 lval* builtin(lenv* e, lval* v, char* func);
 lval* lval_call(lenv* e, lval* f, lval* a);
+lval* lval_eval_call(lenv* e, lval* v);
+linterp* lenv_interp(lenv* e);
 
 /* Evaluate the Sexpr */ 
 lval* lval_eval_sexpr(lenv* e, lval* v) {
+  /* Use the value folded when the enclosing function was defined */
+  if (v->folded && v->epoch == lcount_get(&lpure_epoch) && !e->shadows) {
+    lval* x = v->folded;
+    v->folded = NULL;
+    lval_del(v);
+    return x;
+  }
+  
   /* Evaluate Children */
   for(int i = 0; i < v->count; i++) {
     v->cell[i] = lval_eval(e, v->cell[i]);
   }
   
+  return lval_eval_call(e, v);
+}
+
+/* Call the function an Sexpr's children evaluated to with the rest of them */
+lval* lval_eval_call(lenv* e, lval* v) {
   /* Error Checking */
   for (int i = 0; i < v->count; i++) {
     if(v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
@@ -472,9 +1118,7 @@ lval* lval_eval_sexpr(lenv* e, lval* v) {
   }
   
   /* If so call function to get result */
-  lval* result = lval_call(e, f, v);
-  lval_del(f);
-  return result;
+  return lval_call(e, f, v);
 }
 
 /* Evaluate lval */
@@ -491,6 +1135,43 @@ lval* lval_eval(lenv* e, lval* v) {
   return v;
 }
 
+/* Kinds of AST node as far as reading is concerned */
+enum { LTAG_LIST, LTAG_QEXPR, LTAG_NUMBER, LTAG_SYMBOL, LTAG_STRING, LTAG_SKIP };
+
+/* mpc interns tags, so every node the grammar produces points at one of a
+     handful of strings. Those are looked up once and a node's kind is then
+     found by comparing pointers rather than searching its tag */
+#define LTAG_NUM 9
+struct { char* tag; int kind; } ltags[LTAG_NUM];
+
+int ltag_classify(char* tag) {
+  if (strcmp(tag, "regex") == 0) { return LTAG_SKIP; }
+  if (strcmp(tag, "char") == 0)  { return LTAG_SKIP; }
+  if (strstr(tag, "comment"))    { return LTAG_SKIP; }
+  if (strstr(tag, "string"))     { return LTAG_STRING; }
+  if (strstr(tag, "number"))     { return LTAG_NUMBER; }
+  if (strstr(tag, "symbol"))     { return LTAG_SYMBOL; }
+  if (strstr(tag, "qexpr"))      { return LTAG_QEXPR; }
+  return LTAG_LIST;
+}
+
+void ltag_init(void) {
+  char* names[LTAG_NUM] = { ">", "regex", "char",
+    "expr|number|regex", "expr|symbol|regex", "expr|string|regex",
+    "expr|comment|regex", "expr|sexpr|>", "expr|qexpr|>" };
+  for (int i = 0; i < LTAG_NUM; i++) {
+    ltags[i].tag = mpc_ast_intern(names[i]);
+    ltags[i].kind = ltag_classify(ltags[i].tag);
+  }
+}
+
+int ltag_kind(char* tag) {
+  for (int i = 0; i < LTAG_NUM; i++) {
+    if (ltags[i].tag == tag) { return ltags[i].kind; }
+  }
+  return ltag_classify(tag);
+}
+
 /* Read node tagged as number. Check if double or integer */
 lval* lval_read_num(mpc_ast_t* t) {
   errno = 0;
@@ -519,25 +1200,20 @@ lval* lval_read_str(mpc_ast_t* t) {
 
 /* Read a node */
 lval* lval_read(mpc_ast_t* t) {
+  int kind = ltag_kind(t->tag);
+  
   /* If Symbol String or Number return conversion to that type */
-  if (strstr(t->tag, "string")) { return lval_read_str(t); }
-  if (strstr(t->tag, "number")) { return lval_read_num(t); }
-  if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+  if (kind == LTAG_STRING) { return lval_read_str(t); }
+  if (kind == LTAG_NUMBER) { return lval_read_num(t); }
+  if (kind == LTAG_SYMBOL) { return lval_sym(t->contents); }
   
-  /* If root (>) or sexpr then create empty list */
-  lval* x = NULL;
-  if (strcmp(t->tag, ">") == 0)  { x = lval_sexpr(); }
-  if (strcmp(t->tag, "sexpr"))  { x = lval_sexpr(); }
-  if (strstr(t->tag, "qexpr"))  { x = lval_qexpr(); }
+  /* If qexpr create an empty qexpr, otherwise (root or sexpr) an empty sexpr */
+  lval* x = kind == LTAG_QEXPR ? lval_qexpr() : lval_sexpr();
   
-  /* Fill this list with any valid expression contained within */
+  /* Fill this list with any valid expression contained within, skipping
+       brackets, comments and the regex anchors */
   for (int i = 0; i < t->children_num; i++) {
-    if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-    if (strcmp(t->children[i]->tag, "regex") == 0) { continue; }
-    if (strstr(t->children[i]->tag, "comment")) { continue; }
+    if (ltag_kind(t->children[i]->tag) == LTAG_SKIP) { continue; }
     x = lval_add(x, lval_read(t->children[i]));
   }
   return x;
@@ -549,10 +1225,95 @@ lval* builtin_list(lenv* e, lval* a);
 /* Runs when expression is called and function is evaluated.
      If the number of arguements is less than the formals, return a
      partially evaluated function */
+lval* lmemo_call(lenv* e, lval* f, lval* a);
+lval* lval_join(lval* x, lval* y);
+void lprog_compile(lprog* p, lval* body);
+lval* lprog_run(lenv* e, lprog* p);
+
+/* Number of arguments a user-defined function needs before it can run: its
+     formals up to any '&' */
+int lval_arity(lval* f) {
+  for (int i = 0; i < f->formals->count; i++) {
+    if (strcmp(f->formals->cell[i]->sym, "&") == 0) { return i; }
+  }
+  return f->formals->count;
+}
+
+void lpart_del(lpart* p) {
+  if (--p->refs > 0) { return; }
+  if (p->fn) { lval_del(p->fn); }
+  for (int i = 0; i < p->count; i++) { lval_del(p->args[i]); }
+  free(p->args);
+  free(p);
+}
+
+/* The function a partial application holds, taken from it if nothing else 
+     holds it, so it needn't be copied */
+lval* lpart_fn(lpart* p) {
+  if (p->refs > 1) { return lval_copy(p->fn); }
+  lval* fn = p->fn;
+  p->fn = NULL;
+  return fn;
+}
+
+/* The function of a partial application with the arguments held bound, as if
+     they had been passed to it. Takes v */
+lval* lpart_apply(lval* v) {
+  lpart* p = v->part;
+  lval* fn = lpart_fn(p);
+  
+  for (int i = 0; i < p->count; i++) {
+    lval* sym = lval_pop(fn->formals, 0);
+    lenv_put(fn->env, sym, p->args[i]);
+    lval_del(sym);
+  }
+  lval_del(v);
+  return fn;
+}
+
+/* The function of a partial application, with the arguments held put before 
+     those in *a. Takes v */
+lval* lpart_unwrap(lval* v, lval** a) {
+  lpart* p = v->part;
+  lval* args = lval_sexpr();
+  for (int i = 0; i < p->count; i++) { lval_add(args, lval_copy(p->args[i])); }
+  *a = lval_join(args, *a);
+  lval* fn = lpart_fn(p);
+  lval_del(v);
+  return fn;
+}
+
+/* Call a function with arguments a, taking both */
 lval* lval_call(lenv* e, lval* f, lval* a) {
   /* If a builtin fxn, just call it */
   if(f->builtin) { 
-    return f->builtin(e, a); 
+    lval* result = f->builtin(e, a);
+    lval_del(f);
+    return result;
+  }
+  
+  /* Bind the arguments a partial application holds, then carry on. Those of 
+       a memoised function are passed with a instead, as the cache is keyed on 
+       all of them */
+  if (f->part && f->part->fn->memo) {
+    f = lpart_unwrap(f, &a);
+  } else if (f->part) {
+    f = lpart_apply(f);
+  }
+  
+  /* Memoised functions answer from their cache where they can, once they 
+       have the arguments to run */
+  if (f->memo && f->env->count == 0 && a->count >= lval_arity(f)) {
+    return lmemo_call(e, f, a);
+  }
+  
+  /* Too few arguments: hold on to them, with f, until there are enough */
+  if (a->count < lval_arity(f)) {
+    if (a->count == 0) {
+      lval_del(a);
+      return f;
+    }
+    return lval_part(f, a);
   }
   
   int given = a->count;
@@ -562,6 +1323,7 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
   while (a->count) {
     /* If no more formals to bind to */
     if (f->formals->count == 0) {
+      lval_del(f);
       lval_del(a);
       return lval_err(
         "Function passed too many arguments. "
@@ -574,6 +1336,7 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
     if (strcmp(sym->sym, "&") == 0) {
       /* Ensure '&' is followed by another symbol (list to store x+ variables on */
       if (f->formals->count != 1) {
+        lval_del(f);
         lval_del(a);
         return lval_err("Function format invalid. "
           "Symbol '&' not followed by single symbol.");
@@ -602,6 +1365,7 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
     
     /* Check that & is not passed invalidly */
     if (f->formals->count != 2) {
+      lval_del(f);
       return lval_err("Function formal invalid. "
         "Symbol '&' not followed by sigle symbol.");
     }
@@ -621,12 +1385,32 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
   /* If all formals have been bound */
   if (f->formals->count == 0) {
     f->env->par = e;
-    /* Return with body in new sexpr */
-    return builtin_eval(
-      f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
+    f->env->shadows = f->env->rebinds || e->shadows;
+    /* Run the compiled body if there is one */
+    if (f->code) {
+      lval* result = f->code(f->env, f->consts);
+      lval_del(f);
+      return result;
+    }
+    /* Or the body as threaded code, compiling it once it has been run enough.
+         The program takes the body this call would have used */
+    lprog* p = f->prog;
+    if (p->ops == NULL && ++p->calls >= LPROG_CALLS) { lprog_compile(p, f->body); }
+    if (p->ops) {
+      lval* result = lprog_run(f->env, p);
+      lval_del(f);
+      return result;
+    }
+    /* Return with body in new sexpr. f is used up, so the body is taken
+         rather than copied */
+    lval* body = f->body;
+    f->body = NULL;
+    lval* result = builtin_eval(f->env, lval_add(lval_sexpr(), body));
+    lval_del(f);
+    return result;
   } else {
     /* Return partially evaluated function */
-    return lval_copy(f);
+    return f;
   }
 }
 
@@ -666,6 +1450,9 @@ char* ltype_name(int t) {
     case LVAL_ERR: return "Error";
     case LVAL_SYM: return "Symbol";
     case LVAL_STR: return "String";
+    case LVAL_FUTURE: return "Future";
+    case LVAL_CORO: return "Coroutine";
+    case LVAL_CHAN: return "Channel";
     case LVAL_SEXPR: return "S-Expression";
     case LVAL_QEXPR: return "Q-Expression";
     default: return "Unknown";
@@ -686,41 +1473,45 @@ lval* builtin_op(lenv* e, lval* a, char* op) {
   
   /* Pop first element */
   lval* x = lval_pop(a, 0);
+  /* Operators are told apart by one character: the first, or the second for 
+       max and min */
+  char o = op[1] ? op[1] : op[0];
   /* If no arguments and sub then perform unary negation */
-  if ((strcmp(op, "-") == 0) && a->count == 0) {
+  if (o == '-' && a->count == 0) {
     x->num = -x->num;
   }
   
-  /* While there are still elements remaining */
-  while (a->count > 0) {
-    
-    /* Pop the next element */
-    lval* y = lval_pop(a, 0);
+  /* For each element remaining; a still holds them, and frees them after */
+  for (int i = 0; i < a->count; i++) {
+    lval* y = a->cell[i];
     if (x->type == LVAL_NUM && y->type == LVAL_DOUBLE) x->type = LVAL_DOUBLE;
     
     /* Perform operations */
-    if (strcmp(op, "+") == 0) { x->num += y->num; }
-    if (strcmp(op, "-") == 0) { x->num -= y->num; }
-    if (strcmp(op, "*") == 0) { x->num *= y->num; }
-    if (strcmp(op, "/") == 0) {
-      /* If second operand is zero return error */
-      if (y->num == 0) {
-        lval_del(x);
-        lval_del(y);
-        x = lval_err("Division By Zero."); 
+    switch (o) {
+      case '+': x->num += y->num; break;
+      case '-': x->num -= y->num; break;
+      case '*': x->num *= y->num; break;
+      case '/':
+        /* If second operand is zero return error */
+        if (y->num == 0) {
+          lval_del(x);
+          x = lval_err("Division By Zero."); 
+          break;
+        }
+        x->num /= y->num;
         break;
-      }
-      x->num /= y->num;
-    }
-    if (strcmp(op, "%") == 0) {
-      if (x->type == LVAL_DOUBLE || y->type == LVAL_DOUBLE) {
-        x = lval_err("% with doubles.");
+      case '%':
+        if (x->type == LVAL_DOUBLE || y->type == LVAL_DOUBLE) {
+          lval_del(x);
+          x = lval_err("%% with doubles.");
+          break;
+        }
+        x->num = (long) x->num % (long) y->num;
         break;
-      }
-      x->num = (long) x->num % (long) y->num;
+      case 'a': if (y->num > x->num) { x->num = y->num; } break;
+      case 'i': if (y->num < x->num) { x->num = y->num; } break;
     }
-    /* Delete element now finished with */
-    lval_del(y);
+    if (x->type == LVAL_ERR) { break; }
   }
   /* Delete input expression and return result */
   lval_del(a);
@@ -799,6 +1590,36 @@ lval* builtin_join(lenv* e, lval* a) {
   return x;
 }
 
+/* Function that counts the items of a list */
+lval* builtin_len(lenv* e, lval* a) {
+  LASSERT_NUM("len", a, 1);
+  LASSERT_TYPE("len", a, 0, LVAL_QEXPR);
+  
+  lval* x = lval_num(a->cell[0]->count);
+  lval_del(a);
+  return x;
+}
+
+/* (foldl f z l): f of z and the first item of l, then f of that and the next, 
+     and so on; z if l is empty. Called from here, f sees just what the caller 
+     of foldl sees, with no names of a loop's in between */
+lval* builtin_foldl(lenv* e, lval* a) {
+  LASSERT_NUM("foldl", a, 3);
+  LASSERT_TYPE("foldl", a, 0, LVAL_FUN);
+  LASSERT_TYPE("foldl", a, 2, LVAL_QEXPR);
+  
+  lval* l = lval_pop(a, 2);
+  lval* z = lval_pop(a, 1);
+  lval* f = lval_take(a, 0);
+  for (int i = 0; i < l->count && z->type != LVAL_ERR; i++) {
+    z = lval_call(e, lval_copy(f), lval_add(lval_add(lval_sexpr(), z), lval_copy(l->cell[i])));
+  }
+  
+  lval_del(f);
+  lval_del(l);
+  return z;
+}
+
 /* Builtin math operations */
 lval* builtin_add(lenv* e, lval* a) {
   return builtin_op(e, a, "+");
@@ -817,6 +1638,14 @@ lval* builtin_div(lenv* e, lval* a) {
   return builtin_op(e, a, "/");
 }
 
+lval* builtin_max(lenv* e, lval* a) {
+  return builtin_op(e, a, "max");
+}
+
+lval* builtin_min(lenv* e, lval* a) {
+  return builtin_op(e, a, "min");
+}
+
 lval* builtin_mod(lenv* e, lval* a) {
   return builtin_op(e, a, "%");
 }
@@ -858,7 +1687,7 @@ lval* builtin_var(lenv* e, lval* a, char* func) {
     }
     
     if (strcmp(func, "=") == 0) {
-      lenv_put(e, syms->cell[i], a->cell[i+1]);
+      lenv_put(lenv_local(e, syms->cell[i]), syms->cell[i], a->cell[i+1]);
     }
   }
   
@@ -876,6 +1705,62 @@ lval* builtin_put(lenv* e, lval* a) {
   return builtin_var(e, a, "=");
 }
 
+/* Resolve a symbol naming a pure builtin, if it currently names it in e */
+void lval_fold_sym(lenv* e, lval* v) {
+  int i = lpure_find(v->sym, lsym_bit(v->sym));
+  if (i == -1) { return; }
+  
+  lval* x = lenv_get(e, v);
+  if (x->type == LVAL_FUN && x->builtin == lpure[i].func) {
+    lsite* site = lval_site(v);
+    site->builtin = x->builtin;
+    site->epoch = lcount_get(&lpure_epoch);
+  }
+  lval_del(x);
+}
+
+/* True if v, once evaluated, is a number known now */
+int lval_folds_to_num(lval* v) {
+  if (v->type == LVAL_NUM || v->type == LVAL_DOUBLE) { return 1; }
+  return v->type == LVAL_SEXPR && v->folded && v->epoch == lcount_get(&lpure_epoch);
+}
+
+/* Work out ahead of time what can be of a function body about to be defined in
+     e. Symbols naming pure builtins are resolved to them, and calls of those on
+     numbers are evaluated. The expressions themselves are left as they were,
+     for printing and copying, and their results only used while none of the
+     builtins has been rebound */
+void lval_fold(lenv* e, lval* v) {
+  if (v->type == LVAL_SYM) { lval_fold_sym(e, v); return; }
+  if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return; }
+  
+  /* Innermost first, so their results can be used below */
+  for (int i = 0; i < v->count; i++) { lval_fold(e, v->cell[i]); }
+  
+  if (v->count < 2) { return; }
+  lval* f = v->cell[0];
+  if (f->type != LVAL_SYM || f->site == NULL || f->site->builtin == NULL
+    || f->site->epoch != lcount_get(&lpure_epoch)) { return; }
+  for (int i = 1; i < v->count; i++) {
+    if (!lval_folds_to_num(v->cell[i])) { return; }
+  }
+  
+  lval* a = lval_sexpr();
+  for (int i = 1; i < v->count; i++) {
+    lval* x = v->cell[i];
+    lval_add(a, lval_copy(x->type == LVAL_SEXPR ? x->folded : x));
+  }
+  
+  /* Errors are left to be raised when the function runs */
+  lval* r = f->site->builtin(e, a);
+  if (r->type == LVAL_NUM || r->type == LVAL_DOUBLE) {
+    v->folded = r;
+    v->epoch = lcount_get(&lpure_epoch);
+  } else {
+    lval_del(r);
+  }
+}
+
 /* Lambda function builtin */
 lval* builtin_lambda(lenv* e, lval* a) {
   /* Check that there are 2 Q-Expression arguements */
@@ -894,6 +1779,7 @@ lval* builtin_lambda(lenv* e, lval* a) {
   /* Pass the two arguements to lval_lambda */
   lval* formals = lval_pop(a, 0);
   lval* body = lval_pop(a, 0);
+  lval_fold(e, body);
   
   return lval_lambda(formals, body);
 }
@@ -909,18 +1795,14 @@ lval* builtin_ord(lenv* e, lval* a, char* op) {
       op, ltype_name(a->cell[i]->type), ltype_name(LVAL_NUM), ltype_name(LVAL_DOUBLE));
   }
   
+  /* Told apart by their characters rather than comparing strings */
+  double x = a->cell[0]->num;
+  double y = a->cell[1]->num;
   int r;
-  if (strcmp(op, ">") == 0) {
-    r = (a->cell[0]->num > a->cell[1]->num);
-  }
-  if (strcmp(op, "<") == 0) {
-    r = (a->cell[0]->num > a->cell[1]->num);
-  }
-  if (strcmp(op, ">=") == 0) {
-    r = (a->cell[0]->num > a->cell[1]->num);
-  }
-  if (strcmp(op, "<=") == 0) {
-    r = (a->cell[0]->num > a->cell[1]->num);
+  if (op[0] == '>') {
+    r = op[1] == '=' ? x >= y : x > y;
+  } else {
+    r = op[1] == '=' ? x <= y : x < y;
   }
   lval_del(a);
   return lval_num(r);
@@ -981,13 +1863,23 @@ lval* builtin_not(lenv* e, lval* a) {
   return builtin_log(e, a, "!");
 }
 
+/* Formals of a user-defined function, and in *from the first still to be
+     given (past those a partial application holds) */
+lval* lval_fun_formals(lval* f, int* from) {
+  *from = f->part ? f->part->count : 0;
+  return f->part ? f->part->fn->formals : f->formals;
+}
+
+lval* lval_fun_body(lval* f) {
+  return f->part ? f->part->fn->body : f->body;
+}
+
 int lval_eq(lval* x, lval* y) {
   /* Different types/values/string values always inequal, BUT doubles/numbers equal*/
-  if (x->type != LVAL_NUM && x->type != LVAL_DOUBLE) {
-    if(y->type != LVAL_NUM && y->type != LVAL_DOUBLE) {
-      if (x->type != y->type) { return 0; }
-    }
-  }
+  int xnum = x->type == LVAL_NUM || x->type == LVAL_DOUBLE;
+  int ynum = y->type == LVAL_NUM || y->type == LVAL_DOUBLE;
+  if (xnum != ynum) { return 0; }
+  if (!xnum && x->type != y->type) { return 0; }
   /* Compare based on type */
   switch (x->type) {
     case LVAL_NUM:
@@ -996,13 +1888,23 @@ int lval_eq(lval* x, lval* y) {
     case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
     case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
     case LVAL_STR: return (strcmp(x->str, y->str) == 0);
+    case LVAL_FUTURE: return x->future == y->future;
+    case LVAL_CORO: return x->coro == y->coro;
+    case LVAL_CHAN: return x->chan == y->chan;
     
     case LVAL_FUN: 
       if (x->builtin || y->builtin) {
         return x->builtin == y->builtin;
       } else {
-        return lval_eq(x->formals, y->formals)
-          && lval_eq(x->body, y->body);
+        /* As for printing: by the formals still to be given, and the body */
+        int xi, yi;
+        lval* xf = lval_fun_formals(x, &xi);
+        lval* yf = lval_fun_formals(y, &yi);
+        if (xf->count - xi != yf->count - yi) { return 0; }
+        for (; xi < xf->count; xi++, yi++) {
+          if (!lval_eq(xf->cell[xi], yf->cell[yi])) { return 0; }
+        }
+        return lval_eq(lval_fun_body(x), lval_fun_body(y));
       }
     
     case LVAL_QEXPR:
@@ -1041,9 +1943,246 @@ lval* builtin_ne(lenv* e, lval* a) {
   return builtin_cmp(e, a, "!=");
 }
 
-lval* builtin_if(lenv* e, lval* a) {
-  /* Check if only comparing 3 arguements (1 number, 2 qexprs) */
-  LASSERT_NUM("if", a, 3);
+/* Memoisation */
+/* Results kept by a memoised function unless told otherwise */
+#define LMEMO_LIMIT 4096
+
+uint64_t lhash_bytes(uint64_t h, const void* p, size_t n) {
+  const unsigned char* c = p;
+  while (n--) { h = (h ^ *c++) * 1099511628211ULL; }
+  return h;
+}
+
+/* Hash of a value, consistent with lval_eq: values it finds equal hash alike */
+uint64_t lval_hash(lval* v) {
+  uint64_t h = 14695981039346656037ULL;
+  /* Numbers and doubles are equal by value, so share a type here */
+  int type = v->type == LVAL_DOUBLE ? LVAL_NUM : v->type;
+  h = lhash_bytes(h, &type, sizeof(int));
+  
+  switch (v->type) {
+    case LVAL_NUM:
+    case LVAL_DOUBLE: {
+      /* 0.0 and -0.0 are equal but differ in bits */
+      double num = v->num == 0 ? 0 : v->num;
+      return lhash_bytes(h, &num, sizeof(double));
+    }
+    case LVAL_ERR: return lhash_bytes(h, v->err, strlen(v->err));
+    case LVAL_SYM: return lhash_bytes(h, v->sym, strlen(v->sym));
+    case LVAL_STR: return lhash_bytes(h, v->str, strlen(v->str));
+    case LVAL_FUTURE: return lhash_bytes(h, &v->future, sizeof(lfuture*));
+    case LVAL_CORO: return lhash_bytes(h, &v->coro, sizeof(lcoro*));
+    case LVAL_CHAN: return lhash_bytes(h, &v->chan, sizeof(lchan*));
+    case LVAL_FUN:
+      if (v->builtin) { return lhash_bytes(h, &v->builtin, sizeof(lbuiltin)); }
+      int i;
+      lval* formals = lval_fun_formals(v, &i);
+      for (; i < formals->count; i++) {
+        h = lhash_bytes(h, (uint64_t[]){ lval_hash(formals->cell[i]) }, sizeof(uint64_t));
+      }
+      return lhash_bytes(h, (uint64_t[]){ lval_hash(lval_fun_body(v)) }, sizeof(uint64_t));
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+      h = lhash_bytes(h, &v->count, sizeof(int));
+      for (int i = 0; i < v->count; i++) {
+        h = lhash_bytes(h, (uint64_t[]){ lval_hash(v->cell[i]) }, sizeof(uint64_t));
+      }
+      return h;
+  }
+  return h;
+}
+
+lmemo* lmemo_new(long limit, int policy) {
+  lmemo* m = calloc(1, sizeof(lmemo));
+  m->refs = 1;
+  m->limit = limit;
+  m->policy = policy;
+  m->size = 16;
+  m->table = calloc(m->size, sizeof(lmemo_entry*));
+  return m;
+}
+
+/* Forget every result and reset the counters */
+void lmemo_clear(lmemo* m) {
+  lmemo_entry* en = m->oldest;
+  while (en) {
+    lmemo_entry* newer = en->newer;
+    lval_del(en->args);
+    lval_del(en->result);
+    free(en);
+    en = newer;
+  }
+  memset(m->table, 0, sizeof(lmemo_entry*) * m->size);
+  m->oldest = m->newest = NULL;
+  m->count = m->hits = m->misses = 0;
+}
+
+/* Drop a reference, freeing the cache with the last */
+void lmemo_del(lmemo* m) {
+  if (--m->refs > 0) { return; }
+  lmemo_clear(m);
+  free(m->table);
+  free(m);
+}
+
+/* Take an entry off the oldest to newest list */
+void lmemo_unlink(lmemo* m, lmemo_entry* en) {
+  if (en->older) { en->older->newer = en->newer; } else { m->oldest = en->newer; }
+  if (en->newer) { en->newer->older = en->older; } else { m->newest = en->older; }
+}
+
+/* Put an entry at the newest end of the list */
+void lmemo_append(lmemo* m, lmemo_entry* en) {
+  en->older = m->newest;
+  en->newer = NULL;
+  if (m->newest) { m->newest->newer = en; } else { m->oldest = en; }
+  m->newest = en;
+}
+
+/* Drop the oldest (or least recently used) result */
+void lmemo_evict(lmemo* m) {
+  lmemo_entry* en = m->oldest;
+  lmemo_entry** p = &m->table[en->hash & (m->size - 1)];
+  while (*p != en) { p = &(*p)->next; }
+  *p = en->next;
+  lmemo_unlink(m, en);
+  lval_del(en->args);
+  lval_del(en->result);
+  free(en);
+  m->count--;
+}
+
+/* Double the buckets once there are as many results */
+void lmemo_grow(lmemo* m) {
+  size_t size = m->size * 2;
+  lmemo_entry** table = calloc(size, sizeof(lmemo_entry*));
+  for (lmemo_entry* en = m->oldest; en; en = en->newer) {
+    lmemo_entry** p = &table[en->hash & (size - 1)];
+    en->next = *p;
+    *p = en;
+  }
+  free(m->table);
+  m->table = table;
+  m->size = size;
+}
+
+/* Call a memoised function: give back a copy of an earlier result for equal
+     arguments, or run it and keep what it returns. Errors are not kept. Takes
+     f and a like lval_call */
+lval* lmemo_call(lenv* e, lval* f, lval* a) {
+  lmemo* m = f->memo;
+  uint64_t hash = lval_hash(a);
+  
+  for (lmemo_entry* en = m->table[hash & (m->size - 1)]; en; en = en->next) {
+    if (en->hash == hash && lval_eq(en->args, a)) {
+      m->hits++;
+      if (m->policy == LMEMO_LRU) {
+        lmemo_unlink(m, en);
+        lmemo_append(m, en);
+      }
+      lval_del(f);
+      lval_del(a);
+      return lval_copy(en->result);
+    }
+  }
+  m->misses++;
+  
+  /* Run the function itself, with the cache out of the way. Its reference
+       to the cache is kept until the result is in */
+  lval* args = lval_copy(a);
+  f->memo = NULL;
+  lval* r = lval_call(e, f, a);
+  if (r->type == LVAL_ERR) {
+    lval_del(args);
+    lmemo_del(m);
+    return r;
+  }
+  
+  if (m->limit > 0 && m->count >= m->limit) { lmemo_evict(m); }
+  if ((size_t)m->count >= m->size) { lmemo_grow(m); }
+  
+  lmemo_entry* en = malloc(sizeof(lmemo_entry));
+  en->hash = hash;
+  en->args = args;
+  en->result = lval_copy(r);
+  lmemo_entry** p = &m->table[hash & (m->size - 1)];
+  en->next = *p;
+  *p = en;
+  lmemo_append(m, en);
+  m->count++;
+  lmemo_del(m);
+  return r;
+}
+
+/* Wrap a user-defined function with a cache of its results by arguments. An
+     optional limit on the results kept (0 for none) and "lru" or "fifo" for
+     which goes when full may follow */
+lval* builtin_memo(lenv* e, lval* a) {
+  LASSERT(a, a->count >= 1 && a->count <= 3,
+    "Function 'memo' passed incorrect number of arguments. "
+    "Got %i, expected 1 to 3.", a->count);
+  LASSERT_TYPE("memo", a, 0, LVAL_FUN);
+  LASSERT(a, a->cell[0]->builtin == NULL && a->cell[0]->part == NULL
+    && a->cell[0]->env->count == 0,
+    "Function 'memo' can only wrap a user-defined function "
+    "with no arguments applied.");
+  
+  long limit = LMEMO_LIMIT;
+  int policy = LMEMO_LRU;
+  if (a->count > 1) {
+    LASSERT_TYPE("memo", a, 1, LVAL_NUM);
+    LASSERT(a, a->cell[1]->num >= 0,
+      "Function 'memo' passed a negative limit.");
+    limit = a->cell[1]->num;
+  }
+  if (a->count > 2) {
+    LASSERT_TYPE("memo", a, 2, LVAL_STR);
+    char* name = a->cell[2]->str;
+    LASSERT(a, strcmp(name, "lru") == 0 || strcmp(name, "fifo") == 0,
+      "Function 'memo' passed unknown eviction '%s'. "
+      "Expected \"lru\" or \"fifo\".", name);
+    policy = strcmp(name, "lru") == 0 ? LMEMO_LRU : LMEMO_FIFO;
+  }
+  
+  /* Rewrapping starts a new cache */
+  lval* f = lval_take(a, 0);
+  if (f->memo) { lmemo_del(f->memo); }
+  f->memo = lmemo_new(limit, policy);
+  return f;
+}
+
+/* Counters of a memoised function, as {hits misses results limit} */
+lval* builtin_memo_stats(lenv* e, lval* a) {
+  LASSERT_NUM("memo-stats", a, 1);
+  LASSERT_TYPE("memo-stats", a, 0, LVAL_FUN);
+  LASSERT(a, a->cell[0]->memo != NULL,
+    "Function 'memo-stats' passed a function that is not memoised.");
+  
+  lmemo* m = a->cell[0]->memo;
+  lval* v = lval_qexpr();
+  lval_add(v, lval_num(m->hits));
+  lval_add(v, lval_num(m->misses));
+  lval_add(v, lval_num(m->count));
+  lval_add(v, lval_num(m->limit));
+  lval_del(a);
+  return v;
+}
+
+/* Forget the results of a memoised function and reset its counters */
+lval* builtin_memo_clear(lenv* e, lval* a) {
+  LASSERT_NUM("memo-clear", a, 1);
+  LASSERT_TYPE("memo-clear", a, 0, LVAL_FUN);
+  LASSERT(a, a->cell[0]->memo != NULL,
+    "Function 'memo-clear' passed a function that is not memoised.");
+  
+  lmemo_clear(a->cell[0]->memo);
+  lval_del(a);
+  return lval_sexpr();
+}
+
+lval* builtin_if(lenv* e, lval* a) {
+  /* Check if only comparing 3 arguements (1 number, 2 qexprs) */
+  LASSERT_NUM("if", a, 3);
   LASSERT(a, a->cell[0]->type == LVAL_NUM || a->cell[0]->type == LVAL_DOUBLE,
     "Function 'if' passed incorrect type. "
     "Got %s, expected %s or %s",
@@ -1068,28 +2207,2720 @@ lval* builtin_if(lenv* e, lval* a) {
   return x;
 }
 
-/* Prints data from running programs */
-lval* builtin_print(lenv* e, lval* a) {
-  for (int i = 0; i < a->count; i++) {
-    lval_print(a->cell[i]);
-    putchar(' ');
+/* Loops */
+/* Loops run in C rather than by recursion, so they take constant stack however
+     many times they go round. Their bodies are Q-Expressions, run on a copy each
+     time. Loop variables are bound in an environment of the loop's own under 
+     the calling one, where the body runs, so a global or local of the same 
+     name is left as it was once the loop ends. '=' in the body still binds in 
+     the calling one, unless it names the loop variable */
+
+/* Environment for a loop run from e, to bind its variable in */
+lenv* lenv_loop(lenv* e) {
+  lenv* l = lenv_new();
+  l->par = e;
+  l->shadows = e->shadows;
+  l->loop = 1;
+  return l;
+}
+
+/* Evaluate a copy of a Q-Expression as code, keeping it for the next time */
+lval* lval_eval_copy(lenv* e, lval* q) {
+  lval* x = lval_copy(q);
+  x->type = LVAL_SEXPR;
+  return lval_eval(e, x);
+}
+
+/* Truth of a loop condition; error (taking x) if it is not a number */
+lval* lval_truth(char* func, lval* x, int* truth) {
+  if (x->type == LVAL_ERR) { return x; }
+  if (x->type != LVAL_NUM && x->type != LVAL_DOUBLE) {
+    lval* err = lval_err("Function '%s' condition gave incorrect type. "
+      "Got %s, expected %s or %s",
+      func, ltype_name(x->type), ltype_name(LVAL_NUM), ltype_name(LVAL_DOUBLE));
+    lval_del(x);
+    return err;
+  }
+  *truth = x->num != 0;
+  lval_del(x);
+  return NULL;
+}
+
+/* Run the body of a loop once, returning any error */
+lval* lval_loop_body(lenv* e, lval* body) {
+  lval* x = lval_eval_copy(e, body);
+  if (x->type == LVAL_ERR) { return x; }
+  lval_del(x);
+  return NULL;
+}
+
+/* (while {cond} {body}): run body for as long as cond is true */
+lval* builtin_while(lenv* e, lval* a) {
+  LASSERT_NUM("while", a, 2);
+  LASSERT_TYPE("while", a, 0, LVAL_QEXPR);
+  LASSERT_TYPE("while", a, 1, LVAL_QEXPR);
+  
+  lval* err = NULL;
+  int truth;
+  while (!(err = lval_truth("while", lval_eval_copy(e, a->cell[0]), &truth)) && truth) {
+    if ((err = lval_loop_body(e, a->cell[1]))) { break; }
   }
   
-  putchar('\n');
   lval_del(a);
+  return err ? err : lval_sexpr();
+}
+
+/* (loop {body}): run body until it gives false */
+lval* builtin_loop(lenv* e, lval* a) {
+  LASSERT_NUM("loop", a, 1);
+  LASSERT_TYPE("loop", a, 0, LVAL_QEXPR);
   
-  return lval_sexpr();
+  lval* err = NULL;
+  int truth;
+  while (!(err = lval_truth("loop", lval_eval_copy(e, a->cell[0]), &truth)) && truth) {}
+  
+  lval_del(a);
+  return err ? err : lval_sexpr();
 }
 
-/* Prints errors */
-lval* builtin_error(lenv* e, lval* a) {
-  /* Check if it passes in a single string arguement */
-  LASSERT_NUM("error", a, 1);
-  LASSERT_TYPE("error", a, 0, LVAL_STR);
+/* (dotimes {i} n {body}): run body with i bound to 0 up to n-1 */
+lval* builtin_dotimes(lenv* e, lval* a) {
+  LASSERT_NUM("dotimes", a, 3);
+  LASSERT_TYPE("dotimes", a, 0, LVAL_QEXPR);
+  LASSERT_TYPE("dotimes", a, 1, LVAL_NUM);
+  LASSERT_TYPE("dotimes", a, 2, LVAL_QEXPR);
+  LASSERT(a, a->cell[0]->count == 1 && a->cell[0]->cell[0]->type == LVAL_SYM,
+    "Function 'dotimes' passed incorrect loop variable. "
+    "Expected a single symbol.");
+  
+  lval* err = NULL;
+  lenv* l = lenv_loop(e);
+  long n = a->cell[1]->num;
+  for (long i = 0; i < n; i++) {
+    lval* x = lval_num(i);
+    lenv_put(l, a->cell[0]->cell[0], x);
+    lval_del(x);
+    if ((err = lval_loop_body(l, a->cell[2]))) { break; }
+  }
+  
+  lenv_del(l);
+  lval_del(a);
+  return err ? err : lval_sexpr();
+}
+
+/* (for-each {x} list {body}): run body with x bound to each element of list
+     in turn. The list is walked in place rather than through 'tail' */
+lval* builtin_for_each(lenv* e, lval* a) {
+  LASSERT_NUM("for-each", a, 3);
+  LASSERT_TYPE("for-each", a, 0, LVAL_QEXPR);
+  LASSERT_TYPE("for-each", a, 1, LVAL_QEXPR);
+  LASSERT_TYPE("for-each", a, 2, LVAL_QEXPR);
+  LASSERT(a, a->cell[0]->count == 1 && a->cell[0]->cell[0]->type == LVAL_SYM,
+    "Function 'for-each' passed incorrect loop variable. "
+    "Expected a single symbol.");
+  
+  lval* err = NULL;
+  lenv* l = lenv_loop(e);
+  lval* xs = a->cell[1];
+  for (int i = 0; i < xs->count; i++) {
+    lenv_put(l, a->cell[0]->cell[0], xs->cell[i]);
+    if ((err = lval_loop_body(l, a->cell[2]))) { break; }
+  }
+  
+  lenv_del(l);
+  lval_del(a);
+  return err ? err : lval_sexpr();
+}
+
+/* Thread pool. Work given to other threads runs on a fixed set of them, one 
+     per processor, started on first use and shared by every interpreter. Each 
+     thread has a deque of tasks, plus one more for tasks from threads outside 
+     the pool: a thread takes the newest of its own, and when it has none steals 
+     the oldest of another's, so threads that run out of work take it from those 
+     still busy. A thread waiting on a group of tasks runs that group's queued 
+     tasks itself meanwhile, so tasks may wait on tasks of their own without 
+     the pool running out of threads */
+
+lcoro* lcoro_enter(lcoro* c);
+
+/* Tasks waited on together */
+typedef struct lgroup {
+  int left;
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  /* If set, called by the thread that ran the last task once it is done. The
+       group may be freed by it, but by nothing else until then */
+  void (*after)(struct lgroup*);
+} lgroup;
+
+/* Given its argument and the index of the thread running it (see lpool_self) */
+typedef struct {
+  void (*run)(void*, int);
+  void* arg;
+  lgroup* group;
+} ltask;
+
+/* Queued tasks are tasks[first] to tasks[first+count-1], oldest first */
+typedef struct {
+  pthread_mutex_t lock;
+  ltask* tasks;
+  int first;
+  int count;
+  int size;
+} ldeque;
+
+struct {
+  int threads;
+  /* One per thread, then the one shared by threads outside the pool */
+  ldeque* deques;
+  /* Tasks queued in any deque; idle threads sleep until there are some */
+  long queued;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  /* Holds 1 + the index of a pool thread, on that thread */
+  pthread_key_t self;
+} lpool;
+
+pthread_once_t lpool_once = PTHREAD_ONCE_INIT;
+
+/* Index of the calling thread's deque */
+int lpool_self(void) {
+  intptr_t i = (intptr_t) pthread_getspecific(lpool.self);
+  return i ? i - 1 : lpool.threads;
+}
+
+void lgroup_init(lgroup* g, int count) {
+  g->left = count;
+  g->after = NULL;
+  pthread_mutex_init(&g->lock, NULL);
+  pthread_cond_init(&g->done, NULL);
+}
+
+void lgroup_destroy(lgroup* g) {
+  pthread_mutex_destroy(&g->lock);
+  pthread_cond_destroy(&g->done);
+}
+
+void ldeque_push(ldeque* d, ltask t) {
+  pthread_mutex_lock(&d->lock);
+  if (d->first + d->count == d->size) {
+    /* Reuse the space before the first task, or grow */
+    if (d->first) {
+      memmove(d->tasks, d->tasks + d->first, sizeof(ltask) * d->count);
+      d->first = 0;
+    }
+    if (d->count == d->size) {
+      d->size = d->size ? d->size * 2 : 16;
+      d->tasks = realloc(d->tasks, sizeof(ltask) * d->size);
+    }
+  }
+  d->tasks[d->first + d->count++] = t;
+  pthread_mutex_unlock(&d->lock);
+}
+
+/* Take the newest task, or the oldest if stealing, or if g is given the newest 
+     task of g. Returns 0 if there is none */
+int ldeque_take(ldeque* d, int steal, lgroup* g, ltask* t) {
+  int found = 0;
+  pthread_mutex_lock(&d->lock);
+  if (g) {
+    for (int i = d->first + d->count - 1; i >= d->first; i--) {
+      if (d->tasks[i].group != g) { continue; }
+      *t = d->tasks[i];
+      memmove(d->tasks + i, d->tasks + i + 1, 
+        sizeof(ltask) * (d->first + d->count - 1 - i));
+      d->count--;
+      found = 1;
+      break;
+    }
+  } else if (d->count) {
+    *t = steal ? d->tasks[d->first++] : d->tasks[d->first + d->count - 1];
+    d->count--;
+    found = 1;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+/* Take a task for the thread with deque self, of group g if given */
+int lpool_take(int self, lgroup* g, ltask* t) {
+  int n = lpool.threads + 1;
+  for (int i = 0; i < n; i++) {
+    if (ldeque_take(&lpool.deques[(self + i) % n], i > 0, g, t)) {
+      pthread_mutex_lock(&lpool.lock);
+      lpool.queued--;
+      pthread_mutex_unlock(&lpool.lock);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void lpool_run(ltask* t, int self) {
+  lgroup* g = t->group;
+  /* A task is no part of any coroutine the thread was running */
+  lcoro* co = lcoro_enter(NULL);
+  t->run(t->arg, self);
+  lcoro_enter(co);
+  /* Once the lock is let go, a waiter may free the group */
+  void (*after)(lgroup*) = NULL;
+  pthread_mutex_lock(&g->lock);
+  if (--g->left == 0) {
+    pthread_cond_broadcast(&g->done);
+    after = g->after;
+  }
+  pthread_mutex_unlock(&g->lock);
+  if (after) { after(g); }
+}
+
+void* lpool_worker(void* arg) {
+  int self = (int)(intptr_t) arg;
+  pthread_setspecific(lpool.self, (void*)(intptr_t)(self + 1));
+  ltask t;
+  while (1) {
+    if (lpool_take(self, NULL, &t)) {
+      lpool_run(&t, self);
+      continue;
+    }
+    pthread_mutex_lock(&lpool.lock);
+    while (lpool.queued <= 0) { pthread_cond_wait(&lpool.wake, &lpool.lock); }
+    pthread_mutex_unlock(&lpool.lock);
+  }
+  return NULL;
+}
+
+void lpool_init(void) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  lpool.threads = cpus < 1 ? 1 : cpus;
+  lpool.deques = calloc(lpool.threads + 1, sizeof(ldeque));
+  for (int i = 0; i <= lpool.threads; i++) {
+    pthread_mutex_init(&lpool.deques[i].lock, NULL);
+  }
+  lpool.queued = 0;
+  pthread_mutex_init(&lpool.lock, NULL);
+  pthread_cond_init(&lpool.wake, NULL);
+  pthread_key_create(&lpool.self, NULL);
+  for (int i = 0; i < lpool.threads; i++) {
+    pthread_t t;
+    pthread_create(&t, NULL, lpool_worker, (void*)(intptr_t) i);
+    pthread_detach(t);
+  }
+}
+
+/* Number of threads in the pool, starting it if need be. Threads outside it 
+     have deque index lpool_threads() */
+int lpool_threads(void) {
+  pthread_once(&lpool_once, lpool_init);
+  return lpool.threads;
+}
+
+/* Queue run(arg) as part of group g, on the calling thread's deque */
+void lpool_submit(lgroup* g, void (*run)(void*, int), void* arg) {
+  ltask t = { run, arg, g };
+  ldeque_push(&lpool.deques[lpool_self()], t);
+  pthread_mutex_lock(&lpool.lock);
+  lpool.queued++;
+  pthread_cond_signal(&lpool.wake);
+  pthread_mutex_unlock(&lpool.lock);
+}
+
+/* Wait until every task of g has run, running those still queued meanwhile */
+void lgroup_wait(lgroup* g) {
+  int self = lpool_self();
+  ltask t;
+  while (lpool_take(self, g, &t)) { lpool_run(&t, self); }
+  /* What is left is running on other threads */
+  pthread_mutex_lock(&g->lock);
+  while (g->left > 0) { pthread_cond_wait(&g->done, &g->lock); }
+  pthread_mutex_unlock(&g->lock);
+}
+
+/* Parallel map. The function is applied on the pool to runs of elements at 
+     once. Evaluation changes values it only reads (lookup caches, compiled 
+     bodies, shared counts), so every thread works in its own copy of the 
+     function and of the calling environment, cloned from the originals. 
+     Definitions made while mapping go to those copies and are dropped after */
+
+lenv* lenv_clone(lenv* e);
+
+/* Copy of v sharing nothing with it, made without changing it, so it can be 
+     taken while other threads read v and then used on another thread. A 
+     function compiled ahead of time gets its body back to interpret, as its 
+     compiled code shares the library's constants. Futures, coroutines and 
+     channels are still shared, being made to be used from any thread */
+lval* lval_clone(lval* v) {
+  lval* x;
+  switch (v->type) {
+    case LVAL_SYM: return lval_sym(v->sym);
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+      x = v->type == LVAL_QEXPR ? lval_qexpr() : lval_sexpr();
+      x->count = v->count;
+      x->cell = malloc(sizeof(lval*) * x->count);
+      for (int i = 0; i < x->count; i++) { x->cell[i] = lval_clone(v->cell[i]); }
+      x->folded = v->folded ? lval_clone(v->folded) : NULL;
+      x->epoch = v->epoch;
+      return x;
+    case LVAL_FUN:
+      if (v->builtin) { return lval_fun(v->builtin); }
+      if (v->part) {
+        lval* args = lval_sexpr();
+        for (int i = 0; i < v->part->count; i++) {
+          lval_add(args, lval_clone(v->part->args[i]));
+        }
+        return lval_part(lval_clone(v->part->fn), args);
+      }
+      x = lval_lambda(lval_clone(v->formals),
+        lval_clone(v->prog->ops ? v->prog->body : v->body));
+      lenv_del(x->env);
+      x->env = lenv_clone(v->env);
+      if (v->memo) { x->memo = lmemo_new(v->memo->limit, v->memo->policy); }
+      return x;
+  }
+  return lval_copy(v);
+}
+
+/* Clone of the bindings of e, with no parent */
+lenv* lenv_clone(lenv* e) {
+  lenv* n = lenv_new();
+  n->count = e->count;
+  n->mask = e->mask;
+  n->rebinds = e->rebinds;
+  n->shadows = e->rebinds && !e->interp;
+  n->interp = e->interp;
+  n->shared = e->shared;
+  n->refs = 0;
+  n->loop = e->loop;
+  if (n->shared && latomic_load(&n->shared->refs)) { latomic_add(&n->shared->refs, 1); }
+  n->syms = malloc(sizeof(char*) * n->count);
+  n->vals = malloc(sizeof(lval*) * n->count);
+  for (int i = 0; i < e->count; i++) {
+    n->syms[i] = malloc(strlen(e->syms[i]) + 1);
+    strcpy(n->syms[i], e->syms[i]);
+    n->vals[i] = lval_clone(e->vals[i]);
+  }
+  return n;
+}
+
+/* Clone of e and every environment above it short of the global one, ending 
+     instead in v */
+lenv* lenv_clone_onto(lenv* e, lenv* v) {
+  if (e->par == NULL) { return v; }
+  lenv* n = lenv_clone(e);
+  n->shadows = e->shadows;
+  lenv* c = n;
+  for (; e->par->par; c = c->par, e = e->par) {
+    c->par = lenv_clone(e->par);
+    c->par->shadows = e->par->shadows;
+  }
+  c->par = v;
+  return n;
+}
+
+/* Clone of e's chain ending in a view of its globals. A thread can then call 
+     with it while others do the same, at the cost of cloning only the globals 
+     it uses, as long as the globals do not change meanwhile */
+lenv* lenv_view(lenv* e) {
+  lenv* g = e;
+  while (g->par) { g = g->par; }
+  /* A view of a view has the bindings it has cloned in so far too */
+  lenv* v = g->shared ? lenv_clone(g) : lenv_new();
+  if (!g->shared) {
+    v->interp = g->interp;
+    v->shared = g;
+  }
+  return lenv_clone_onto(e, v);
+}
+
+/* Clone of e's chain ending in a view of a snapshot of its globals, which the 
+     caller may go on changing. A snapshot is a clone never written, so any 
+     number of views can read it at once; an interpreter keeps one for all its 
+     futures until its globals next change */
+lenv* lenv_view_snapshot(lenv* e) {
+  lenv* g = e;
+  while (g->par) { g = g->par; }
+  if (g->shared && latomic_load(&g->shared->refs)) { return lenv_view(e); }
+  
+  lenv* v;
+  linterp* lisp = g->interp;
+  if (lisp && lisp->env == g) {
+    if (lisp->snapshot == NULL) {
+      lisp->snapshot = lenv_clone(g);
+      lisp->snapshot->refs = 1;
+    }
+    latomic_add(&lisp->snapshot->refs, 1);
+    v = lenv_new();
+    v->interp = lisp;
+    v->shared = lisp->snapshot;
+  } else {
+    /* A view of globals being waited on, as on the pool: one of its own */
+    lenv* s = lenv_clone(g->shared ? g->shared : g);
+    s->refs = 1;
+    v = g->shared ? lenv_clone(g) : lenv_new();
+    v->interp = g->interp;
+    v->shared = s;
+  }
+  return lenv_clone_onto(e, v);
+}
+
+void lenv_del_chain(lenv* e) {
+  while (e) {
+    lenv* par = e->par;
+    lenv_del(e);
+    e = par;
+  }
+}
+
+/* A function called on the pool, and the environment it is called from. Each 
+     thread calls its own copies of them, made the first time it needs them. 
+     The globals are only read while the caller waits, so they are shared 
+     rather than copied */
+typedef struct {
+  lenv* env;
+  lval* f;
+  /* Per thread, by deque index */
+  lenv** envs;
+  lval** fs;
+} lpar;
+
+void lpar_init(lpar* p, lenv* e, lval* f) {
+  int threads = lpool_threads() + 1;
+  p->env = e;
+  p->f = f;
+  p->envs = calloc(threads, sizeof(lenv*));
+  p->fs = calloc(threads, sizeof(lval*));
+}
+
+void lpar_free(lpar* p) {
+  for (int i = 0; i <= lpool.threads; i++) {
+    if (p->envs[i]) {
+      lenv_del_chain(p->envs[i]);
+      lval_del(p->fs[i]);
+    }
+  }
+  free(p->envs);
+  free(p->fs);
+}
+
+/* Call the function on the thread with deque self, taking args */
+lval* lpar_call(lpar* p, int self, lval* args) {
+  if (p->envs[self] == NULL) {
+    p->envs[self] = lenv_view(p->env);
+    p->fs[self] = lval_clone(p->f);
+  }
+  return lval_call(p->envs[self], lval_copy(p->fs[self]), args);
+}
+
+/* Elements first to last-1 of a list some call is working through, the 
+     index-th run of them */
+typedef struct {
+  void* call;
+  int index;
+  int first;
+  int last;
+} lrun;
+
+/* Number of runs count elements are split into */
+int lpool_split(int count) {
+  /* Several runs per thread keeps them busy when elements take uneven time */
+  int threads = lpool_threads() + 1;
+  return count < threads * 4 ? count : threads * 4;
+}
+
+/* Split count elements into runs and do every run on the pool */
+void lpool_runs(void* call, int count, void (*run)(void*, int)) {
+  int runs = lpool_split(count);
+  lrun* rs = malloc(sizeof(lrun) * runs);
+  lgroup g;
+  lgroup_init(&g, runs);
+  for (int i = 0; i < runs; i++) {
+    rs[i] = (lrun){ call, i, (long) count * i / runs, (long) count * (i + 1) / runs };
+    lpool_submit(&g, run, &rs[i]);
+  }
+  lgroup_wait(&g);
+  lgroup_destroy(&g);
+  free(rs);
+}
+
+/* A call of pmap or pfilter, shared by the tasks doing it */
+typedef struct {
+  char* func;
+  lpar par;
+  lval* list;
+  /* Per element; the result, or for pfilter whether to keep it */
+  lval** results;
+  int* keep;
+  /* Lowest index of an element giving an error so far. Later elements need 
+       not be done, as their results are thrown away */
+  int error;
+  pthread_mutex_t lock;
+} lpmap;
+
+void lpmap_task(void* arg, int self) {
+  lrun* r = arg;
+  lpmap* m = r->call;
+  for (int i = r->first; i < r->last; i++) {
+    pthread_mutex_lock(&m->lock);
+    int skip = i > m->error;
+    pthread_mutex_unlock(&m->lock);
+    if (skip) { return; }
+    
+    lval* x = lpar_call(&m->par, self,
+      lval_add(lval_sexpr(), lval_clone(m->list->cell[i])));
+    if (m->keep) { x = lval_truth(m->func, x, &m->keep[i]); }
+    if (x == NULL) { continue; }
+    m->results[i] = x;
+    if (x->type == LVAL_ERR) {
+      pthread_mutex_lock(&m->lock);
+      if (i < m->error) { m->error = i; }
+      pthread_mutex_unlock(&m->lock);
+    }
+  }
+}
+
+/* (pmap f list) or (pfilter f list); as map and filter, with f applied to 
+     the elements in parallel. The error of the first element to give one is 
+     returned, as it would be by map or filter */
+lval* builtin_par(lenv* e, lval* a, char* func) {
+  LASSERT_NUM(func, a, 2);
+  LASSERT_TYPE(func, a, 0, LVAL_FUN);
+  LASSERT_TYPE(func, a, 1, LVAL_QEXPR);
+  
+  lpmap m;
+  m.func = func;
+  lpar_init(&m.par, e, a->cell[0]);
+  m.list = a->cell[1];
+  int count = m.list->count;
+  m.results = calloc(count, sizeof(lval*));
+  m.keep = strcmp(func, "pfilter") == 0 ? calloc(count, sizeof(int)) : NULL;
+  m.error = count;
+  pthread_mutex_init(&m.lock, NULL);
+  lpool_runs(&m, count, lpmap_task);
+  
+  lval* x;
+  if (m.error < count) {
+    x = m.results[m.error];
+    m.results[m.error] = NULL;
+  } else if (m.keep) {
+    /* Keep the elements themselves, moved out of the list */
+    x = lval_qexpr();
+    for (int i = 0; i < count; i++) {
+      if (m.keep[i]) { lval_add(x, m.list->cell[i]); }
+      else { lval_del(m.list->cell[i]); }
+    }
+    m.list->count = 0;
+  } else {
+    x = lval_qexpr();
+    x->count = count;
+    x->cell = m.results;
+    m.results = NULL;
+  }
+  
+  if (m.results) {
+    for (int i = 0; i < count; i++) { if (m.results[i]) { lval_del(m.results[i]); } }
+    free(m.results);
+  }
+  free(m.keep);
+  lpar_free(&m.par);
+  pthread_mutex_destroy(&m.lock);
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_pmap(lenv* e, lval* a) {
+  return builtin_par(e, a, "pmap");
+}
+
+lval* builtin_pfilter(lenv* e, lval* a) {
+  return builtin_par(e, a, "pfilter");
+}
+
+/* Parallel reduce. The list is cut into runs, each reduced on the pool from 
+     its first element, and the results of the runs are combined in order onto 
+     the identity on the calling thread. For an associative function that is 
+     the left fold foldl does. Lists of numbers reduced with the builtin +, *, 
+     max or min are reduced by a native loop rather than by calling it */
+
+/* Lists shorter than this are reduced natively on the calling thread alone */
+#define LREDUCE_PARALLEL_MIN (1 << 14)
+/* Numbers gathered from a list at a time to be reduced natively */
+#define LREDUCE_BLOCK 256
+
+/* Step of a native reduction, as builtin_op does it */
+#define LREDUCE_ADD(x, y) ((x) + (y))
+#define LREDUCE_MUL(x, y) ((x) * (y))
+#define LREDUCE_MAX(x, y) ((y) > (x) ? (y) : (x))
+#define LREDUCE_MIN(x, y) ((y) < (x) ? (y) : (x))
+
+/* Four running results, so that no step waits on the one before and the 
+     compiler can put them side by side in vector registers */
+#define LREDUCE_LOOP(step) \
+  for (; i + 4 <= n; i += 4) { \
+    r[0] = step(r[0], xs[i]);     r[1] = step(r[1], xs[i + 1]); \
+    r[2] = step(r[2], xs[i + 2]); r[3] = step(r[3], xs[i + 3]); \
+  } \
+  r[0] = step(step(r[0], r[1]), step(r[2], r[3])); \
+  for (; i < n; i++) { r[0] = step(r[0], xs[i]); }
+
+/* Reduce n > 0 numbers with the operator o, as told apart in builtin_op */
+double lreduce_nums(char o, double* xs, int n) {
+  if (n < 4) {
+    double x = xs[0];
+    for (int i = 1; i < n; i++) {
+      switch (o) {
+        case '+': x = LREDUCE_ADD(x, xs[i]); break;
+        case '*': x = LREDUCE_MUL(x, xs[i]); break;
+        case 'a': x = LREDUCE_MAX(x, xs[i]); break;
+        case 'i': x = LREDUCE_MIN(x, xs[i]); break;
+      }
+    }
+    return x;
+  }
+  
+  double r[4] = { xs[0], xs[1], xs[2], xs[3] };
+  int i = 4;
+  switch (o) {
+    case '+': LREDUCE_LOOP(LREDUCE_ADD); break;
+    case '*': LREDUCE_LOOP(LREDUCE_MUL); break;
+    case 'a': LREDUCE_LOOP(LREDUCE_MAX); break;
+    case 'i': LREDUCE_LOOP(LREDUCE_MIN); break;
+  }
+  return r[0];
+}
+
+/* Operator of a builtin preduce reduces natively, as builtin_op takes it, 
+     else NULL */
+char* lreduce_op(lval* f) {
+  if (f->builtin == builtin_add) { return "+"; }
+  if (f->builtin == builtin_mul) { return "*"; }
+  if (f->builtin == builtin_max) { return "max"; }
+  if (f->builtin == builtin_min) { return "min"; }
+  return NULL;
+}
+
+/* Result of reducing one run natively */
+typedef struct {
+  double num;
+  /* Whether a Double was met, and whether anything not a number was */
+  int doubles;
+  int bad;
+} lreduce_part;
+
+/* A call of preduce, shared by the tasks doing it */
+typedef struct {
+  lval* list;
+  /* Operator if reducing natively, else the function */
+  char op;
+  lpar par;
+  /* Per run */
+  lreduce_part* parts;
+  lval** results;
+} lreduce;
+
+/* Gather the numbers of a run in blocks and reduce each natively */
+void lreduce_native_task(void* arg, int self) {
+  lrun* r = arg;
+  lreduce* c = r->call;
+  lreduce_part* p = &c->parts[r->index];
+  double xs[LREDUCE_BLOCK];
+  p->doubles = 0;
+  p->bad = 0;
+  for (int i = r->first; i < r->last; i += LREDUCE_BLOCK) {
+    int n = r->last - i < LREDUCE_BLOCK ? r->last - i : LREDUCE_BLOCK;
+    for (int k = 0; k < n; k++) {
+      lval* x = c->list->cell[i + k];
+      if (x->type == LVAL_DOUBLE) { p->doubles = 1; }
+      else if (x->type != LVAL_NUM) { p->bad = 1; return; }
+      xs[k] = x->num;
+    }
+    double y = lreduce_nums(c->op, xs, n);
+    if (i == r->first) { p->num = y; }
+    else { double pair[2] = { p->num, y }; p->num = lreduce_nums(c->op, pair, 2); }
+  }
+}
+
+/* Reduce a run by calling the function from its first element on */
+void lreduce_task(void* arg, int self) {
+  lrun* r = arg;
+  lreduce* c = r->call;
+  lval* x = lval_clone(c->list->cell[r->first]);
+  for (int i = r->first + 1; i < r->last && x->type != LVAL_ERR; i++) {
+    x = lpar_call(&c->par, self,
+      lval_add(lval_add(lval_sexpr(), x), lval_clone(c->list->cell[i])));
+  }
+  c->results[r->index] = x;
+}
+
+/* (preduce f z list): list reduced with the associative function f, of which 
+     z is the identity. Equal to (foldl f z list) */
+lval* builtin_preduce(lenv* e, lval* a) {
+  LASSERT_NUM("preduce", a, 3);
+  LASSERT_TYPE("preduce", a, 0, LVAL_FUN);
+  LASSERT_TYPE("preduce", a, 2, LVAL_QEXPR);
+  
+  lval* f = a->cell[0];
+  lval* z = a->cell[1];
+  lreduce c;
+  c.list = a->cell[2];
+  int count = c.list->count;
+  if (count == 0) { return lval_take(a, 1); }
+  
+  char* op = (z->type == LVAL_NUM || z->type == LVAL_DOUBLE) ? lreduce_op(f) : NULL;
+  if (op) {
+    c.op = op[1] ? op[1] : op[0];
+    int runs = count < LREDUCE_PARALLEL_MIN ? 1 : lpool_split(count);
+    c.parts = malloc(sizeof(lreduce_part) * runs);
+    if (runs == 1) {
+      lrun r = { &c, 0, 0, count };
+      lreduce_native_task(&r, 0);
+    } else {
+      lpool_runs(&c, count, lreduce_native_task);
+    }
+    
+    /* Onto the identity, then each run in order */
+    double xs[2] = { z->num, 0 };
+    int doubles = z->type == LVAL_DOUBLE, bad = 0;
+    for (int i = 0; i < runs; i++) {
+      xs[1] = c.parts[i].num;
+      doubles |= c.parts[i].doubles;
+      bad |= c.parts[i].bad;
+      if (!bad) { xs[0] = lreduce_nums(c.op, xs, 2); }
+    }
+    free(c.parts);
+    /* The error the builtin gives for any argument not a number */
+    LASSERT(a, !bad, "Function '%s' passed incorrect type for argument 1. "
+      "Expected %s or %s.", op, ltype_name(LVAL_NUM), ltype_name(LVAL_DOUBLE));
+    lval* x = lval_double(xs[0]);
+    if (!doubles) { x->type = LVAL_NUM; }
+    lval_del(a);
+    return x;
+  }
+  
+  lpar_init(&c.par, e, f);
+  int runs = lpool_split(count);
+  c.results = calloc(runs, sizeof(lval*));
+  lpool_runs(&c, count, lreduce_task);
+  lpar_free(&c.par);
+  
+  /* Onto the identity, then each run in order, stopping at an error */
+  lval* x = lval_copy(z);
+  for (int i = 0; i < runs; i++) {
+    if (x->type == LVAL_ERR) {
+      lval_del(c.results[i]);
+    } else if (c.results[i]->type == LVAL_ERR) {
+      lval_del(x);
+      x = c.results[i];
+    } else {
+      x = lval_call(e, lval_copy(f), lval_add(lval_add(lval_sexpr(), x), c.results[i]));
+    }
+  }
+  free(c.results);
+  lval_del(a);
+  return x;
+}
+
+/* Futures. spawn evaluates an expression on the pool in a copy of the calling 
+     environment taken there and then, so it sees the definitions of the time 
+     and nothing done after, and what it defines is its own. await waits for 
+     the value, running the evaluation itself if no thread has started it */
+
+struct lfuture {
+  /* First, so the group's after function can find the future */
+  lgroup group;
+  /* Guarded by the group's lock. The task evaluating it holds one */
+  int refs;
+  lval* expr;
+  lenv* env;
+  lval* result;
+};
+
+lval* lval_future(lfuture* f) {
+  lval* v = lval_new(LVAL_FUTURE);
+  v->future = f;
+  return v;
+}
+
+void lfuture_retain(lfuture* f) {
+  pthread_mutex_lock(&f->group.lock);
+  f->refs++;
+  pthread_mutex_unlock(&f->group.lock);
+}
+
+void lfuture_release(lfuture* f) {
+  pthread_mutex_lock(&f->group.lock);
+  int last = --f->refs == 0;
+  pthread_mutex_unlock(&f->group.lock);
+  if (!last) { return; }
+  if (f->result) { lval_del(f->result); }
+  lgroup_destroy(&f->group);
+  free(f);
+}
+
+/* The task's hold on the future ends once it has run */
+void lfuture_after(lgroup* g) {
+  lfuture_release((lfuture*) g);
+}
+
+void lfuture_task(void* arg, int self) {
+  lfuture* f = arg;
+  f->result = lval_eval(f->env, f->expr);
+  /* The result may share counts with the environment, so it goes here and not 
+       on whichever thread lets go of the future last */
+  lenv_del_chain(f->env);
+  f->expr = NULL;
+  f->env = NULL;
+}
+
+/* Wait for a future, returning a copy of its value. Copies are clones, as 
+     other threads may be copying the value at the same time */
+lval* lfuture_await(lfuture* f) {
+  lgroup_wait(&f->group);
+  return lval_clone(f->result);
+}
+
+/* (spawn {expr}): a future of the value of expr */
+lval* builtin_spawn(lenv* e, lval* a) {
+  LASSERT_NUM("spawn", a, 1);
+  LASSERT_TYPE("spawn", a, 0, LVAL_QEXPR);
+  lpool_threads();
+  
+  lfuture* f = malloc(sizeof(lfuture));
+  lgroup_init(&f->group, 1);
+  f->group.after = lfuture_after;
+  f->refs = 2;
+  f->expr = lval_clone(a->cell[0]);
+  f->expr->type = LVAL_SEXPR;
+  f->env = lenv_view_snapshot(e);
+  f->result = NULL;
+  lpool_submit(&f->group, lfuture_task, f);
+  lval_del(a);
+  return lval_future(f);
+}
+
+/* (await future): its value */
+lval* builtin_await(lenv* e, lval* a) {
+  LASSERT_NUM("await", a, 1);
+  LASSERT_TYPE("await", a, 0, LVAL_FUTURE);
+  lval* x = lfuture_await(a->cell[0]->future);
+  lval_del(a);
+  return x;
+}
+
+/* (await-all {futures...}): a list of their values, or the first error among 
+     them */
+lval* builtin_await_all(lenv* e, lval* a) {
+  LASSERT_NUM("await-all", a, 1);
+  LASSERT_TYPE("await-all", a, 0, LVAL_QEXPR);
+  lval* l = a->cell[0];
+  for (int i = 0; i < l->count; i++) {
+    LASSERT(a, l->cell[i]->type == LVAL_FUTURE,
+      "Function 'await-all' passed incorrect type for element %i. "
+      "Got %s, expected %s.", i, ltype_name(l->cell[i]->type), ltype_name(LVAL_FUTURE));
+  }
+  
+  lval* x = lval_qexpr();
+  for (int i = 0; i < l->count; i++) {
+    lval* y = lfuture_await(l->cell[i]->future);
+    if (y->type == LVAL_ERR) {
+      lval_del(x);
+      x = y;
+      break;
+    }
+    lval_add(x, y);
+  }
+  lval_del(a);
+  return x;
+}
+
+/* Coroutines. Each runs its function on a stack of its own, switched to and 
+     from on the thread that resumes it, so yield can suspend it from any depth 
+     of evaluation. Stacks are only touched as far as they are used, so 
+     thousands of coroutines cost little more than what they hold. As with 
+     any call, free symbols in the function are looked up from whoever called 
+     it, here whoever resumed it last. go and run schedule coroutines as green 
+     threads, each thread of the process keeping its own queue of them */
+
+/* Bytes of stack each coroutine has by default, as much as the main thread 
+     usually gets. It is mapped, not allocated, so only pages touched take 
+     memory, and a page below it is left inaccessible, so running off the end 
+     faults there rather than writing over the heap */
+#define LCORO_STACK (8 << 20)
+
+/* Set from --coro-stack before any coroutine starts */
+size_t lcoro_stack_size = LCORO_STACK;
+
+enum { LCORO_NEW, LCORO_SUSPENDED, LCORO_RUNNING, LCORO_DONE };
+
+struct lcoro {
+  /* Guards refs and state */
+  pthread_mutex_t lock;
+  int refs;
+  int state;
+  /* Set if the last copy is deleted while it is suspended. It is then run to 
+       the end with every yield giving an error, so what it holds is freed */
+  int cancel;
+  /* The function and its arguments, until it starts */
+  lval* fn;
+  lval* args;
+  /* Parent of the function's environment, given that of whoever resumes it */
+  lenv* base;
+  /* Value passed by resume or yield, or the function's result */
+  lval* transfer;
+  char* stack;
+  size_t stack_size;
+#ifndef _WIN32
+  ucontext_t ctx;
+  ucontext_t caller;
+#endif
+};
+
+/* Per thread: the coroutine running, and a ring of those go has made ready */
+typedef struct {
+  lcoro* current;
+  /* The coroutine run last resumed, while it runs */
+  lcoro* scheduled;
+  /* Set when the coroutine running yields only to wait on a channel */
+  int blocked;
+  lval** ready;
+  int first;
+  int count;
+  int size;
+} lcoro_thread;
+
+pthread_key_t lcoro_key;
+
+void lcoro_thread_del(void* arg) {
+  lcoro_thread* t = arg;
+  for (int i = 0; i < t->count; i++) { lval_del(t->ready[(t->first + i) % t->size]); }
+  free(t->ready);
+  free(t);
+}
+
+void lcoro_init(void) {
+  pthread_key_create(&lcoro_key, lcoro_thread_del);
+}
+
+lcoro_thread* lcoro_self(void) {
+  lcoro_thread* t = pthread_getspecific(lcoro_key);
+  if (t == NULL) {
+    t = calloc(1, sizeof(lcoro_thread));
+    pthread_setspecific(lcoro_key, t);
+  }
+  return t;
+}
+
+lcoro* lcoro_enter(lcoro* c) {
+  lcoro_thread* t = lcoro_self();
+  lcoro* prev = t->current;
+  t->current = c;
+  return prev;
+}
+
+void lcoro_ready_push(lcoro_thread* t, lval* v) {
+  if (t->count == t->size) {
+    /* Grow, unwrapping the ring */
+    int size = t->size ? t->size * 2 : 16;
+    lval** ready = malloc(sizeof(lval*) * size);
+    for (int i = 0; i < t->count; i++) { ready[i] = t->ready[(t->first + i) % t->size]; }
+    free(t->ready);
+    t->ready = ready;
+    t->first = 0;
+    t->size = size;
+  }
+  t->ready[(t->first + t->count++) % t->size] = v;
+}
+
+lval* lcoro_ready_pop(lcoro_thread* t) {
+  lval* v = t->ready[t->first];
+  t->first = (t->first + 1) % t->size;
+  t->count--;
+  return v;
+}
+
+lval* lval_coro(lcoro* c) {
+  lval* v = lval_new(LVAL_CORO);
+  v->coro = c;
+  return v;
+}
+
+void lcoro_retain(lcoro* c) {
+  pthread_mutex_lock(&c->lock);
+  c->refs++;
+  pthread_mutex_unlock(&c->lock);
+}
+
+int lcoro_state(lcoro* c) {
+  pthread_mutex_lock(&c->lock);
+  int state = c->state;
+  pthread_mutex_unlock(&c->lock);
+  return state;
+}
+
+void lcoro_set_state(lcoro* c, int state) {
+  pthread_mutex_lock(&c->lock);
+  c->state = state;
+  pthread_mutex_unlock(&c->lock);
+}
+
+#ifndef _WIN32
+/* Map a stack for c, with the guard page below it. Returns 0 if there is no 
+     room for it */
+int lcoro_stack_new(lcoro* c) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t size = (lcoro_stack_size + page - 1) / page * page;
+  char* map = mmap(NULL, size + page, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) { return 0; }
+  if (mprotect(map, page, PROT_NONE) != 0) {
+    munmap(map, size + page);
+    return 0;
+  }
+  c->stack = map + page;
+  c->stack_size = size;
+  return 1;
+}
+
+void lcoro_stack_del(lcoro* c) {
+  if (c->stack == NULL) { return; }
+  size_t page = sysconf(_SC_PAGESIZE);
+  munmap(c->stack - page, c->stack_size + page);
+  c->stack = NULL;
+}
+
+/* Where a coroutine starts, on its own stack, once resume has made it the one 
+     running on the thread */
+void lcoro_entry(void) {
+  lcoro* c = lcoro_self()->current;
+  lval* fn = c->fn;
+  lval* args = c->args;
+  c->fn = NULL;
+  c->args = NULL;
+  c->transfer = lval_call(c->base, fn, args);
+  lcoro_set_state(c, LCORO_DONE);
+  /* Back to the last resume, for good */
+  setcontext(&c->caller);
+}
+#endif
+
+/* Run c, in e, until it yields or finishes, passing it v (taken) as the value 
+     of the yield it is suspended in. Returns what it yields, or its result */
+lval* lcoro_resume(lenv* e, lcoro* c, lval* v) {
+  pthread_mutex_lock(&c->lock);
+  int state = c->state;
+  if (state == LCORO_NEW || state == LCORO_SUSPENDED) { c->state = LCORO_RUNNING; }
+  pthread_mutex_unlock(&c->lock);
+  if (state == LCORO_RUNNING || state == LCORO_DONE) {
+    lval_del(v);
+    return lval_err(state == LCORO_RUNNING ? "Coroutine resumed while running."
+      : "Coroutine resumed after it finished.");
+  }
+  
+#ifdef _WIN32
+  lval_del(v);
+  lcoro_set_state(c, LCORO_DONE);
+  return lval_err("Coroutines are not supported on this platform.");
+#else
+  if (state == LCORO_NEW) {
+    /* Its function takes the arguments it was made with instead */
+    lval_del(v);
+    v = NULL;
+    if (!lcoro_stack_new(c)) {
+      lcoro_set_state(c, LCORO_DONE);
+      return lval_err("Could not allocate a coroutine stack.");
+    }
+    getcontext(&c->ctx);
+    c->ctx.uc_stack.ss_sp = c->stack;
+    c->ctx.uc_stack.ss_size = c->stack_size;
+    c->ctx.uc_link = NULL;
+    makecontext(&c->ctx, lcoro_entry, 0);
+  }
+  
+  c->base->par = e;
+  c->transfer = v;
+  lcoro* prev = lcoro_enter(c);
+  swapcontext(&c->caller, &c->ctx);
+  lcoro_enter(prev);
+  c->base->par = NULL;
+  
+  lval* x = c->transfer;
+  c->transfer = NULL;
+  pthread_mutex_lock(&c->lock);
+  if (c->state == LCORO_RUNNING) { c->state = LCORO_SUSPENDED; }
+  state = c->state;
+  pthread_mutex_unlock(&c->lock);
+  if (state == LCORO_DONE) { lcoro_stack_del(c); }
+  return x;
+#endif
+}
+
+void lcoro_release(lcoro* c) {
+  pthread_mutex_lock(&c->lock);
+  int last = --c->refs == 0;
+  pthread_mutex_unlock(&c->lock);
+  if (!last) { return; }
+  
+  if (c->state == LCORO_SUSPENDED) {
+    c->cancel = 1;
+    lval_del(lcoro_resume(NULL, c, lval_err("Coroutine deleted before it finished.")));
+  }
+  if (c->fn) { lval_del(c->fn); }
+  if (c->args) { lval_del(c->args); }
+  lenv_del(c->base);
+#ifndef _WIN32
+  lcoro_stack_del(c);
+#endif
+  pthread_mutex_destroy(&c->lock);
+  free(c);
+}
+
+/* (coroutine f & args): a coroutine that calls f with args when first resumed */
+lval* builtin_coroutine(lenv* e, lval* a) {
+  LASSERT(a, a->count >= 1, "Function 'coroutine' passed no function.");
+  LASSERT_TYPE("coroutine", a, 0, LVAL_FUN);
+  lcoro* c = calloc(1, sizeof(lcoro));
+  pthread_mutex_init(&c->lock, NULL);
+  c->refs = 1;
+  c->state = LCORO_NEW;
+  /* Cloned, as it may be resumed on another thread while the values it was 
+       made from are still in use on this one */
+  c->fn = lval_clone(a->cell[0]);
+  c->args = lval_sexpr();
+  for (int i = 1; i < a->count; i++) { lval_add(c->args, lval_clone(a->cell[i])); }
+  lval_del(a);
+  /* For load and the like, if it is ever run with no one to resume it */
+  c->base = lenv_new();
+  c->base->interp = lenv_interp(e);
+  /* Each resume hangs the base under whoever resumes it, so frames inside 
+       may outlive the chain they were checked against */
+  c->base->shadows = 1;
+  return lval_coro(c);
+}
+
+/* (resume co) or (resume co x): run co until it yields or finishes, giving x, 
+     or () if none, as the value of the yield it is suspended in. Returns the 
+     value yielded, or once it finishes, the value its function returned */
+lval* builtin_resume(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1 || a->count == 2,
+    "Function 'resume' passed %i arguments. Expected 1 or 2.", a->count);
+  LASSERT_TYPE("resume", a, 0, LVAL_CORO);
+  lval* v = a->count == 2 ? lval_pop(a, 1) : lval_sexpr();
+  lval* x = lcoro_resume(e, a->cell[0]->coro, v);
+  lval_del(a);
+  return x;
+}
+
+/* Suspend c, the coroutine running, making x (taken) the value of the resume 
+     that ran it. Returns the value it is resumed with */
+lval* lcoro_yield(lcoro* c, lval* x) {
+  if (c->cancel) {
+    lval_del(x);
+    return lval_err("Coroutine deleted before it finished.");
+  }
+  c->transfer = x;
+#ifndef _WIN32
+  swapcontext(&c->ctx, &c->caller);
+#endif
+  lval* r = c->transfer;
+  c->transfer = NULL;
+  return r;
+}
+
+/* (yield x): suspend the coroutine running, making x the value of the resume 
+     that ran it */
+lval* builtin_yield(lenv* e, lval* a) {
+  lcoro* c = lcoro_self()->current;
+  LASSERT(a, c != NULL, "Function 'yield' called outside a coroutine.");
+  LASSERT_NUM("yield", a, 1);
+  return lcoro_yield(c, lval_take(a, 0));
+}
+
+/* (co-status co): "new", "suspended", "running" or "done" */
+lval* builtin_co_status(lenv* e, lval* a) {
+  LASSERT_NUM("co-status", a, 1);
+  LASSERT_TYPE("co-status", a, 0, LVAL_CORO);
+  char* names[] = { "new", "suspended", "running", "done" };
+  lval* x = lval_str(names[lcoro_state(a->cell[0]->coro)]);
+  lval_del(a);
+  return x;
+}
+
+/* (go f & args): a coroutine as coroutine makes, queued on this thread for run */
+lval* builtin_go(lenv* e, lval* a) {
+  lval* x = builtin_coroutine(e, a);
+  if (x->type == LVAL_CORO) { lcoro_ready_push(lcoro_self(), lval_copy(x)); }
+  return x;
+}
+
+uint64_t lchan_events(void);
+void lchan_sleep(uint64_t seen);
+
+/* (run ()): resume the coroutines queued on this thread in turn, each until it 
+     yields, until all have finished, including those queued meanwhile. Errors 
+     they finish with are printed, as load prints those of top-level 
+     expressions. Once all are waiting on channels, the thread sleeps until 
+     one changes */
+lval* builtin_run(lenv* e, lval* a) {
+  LASSERT_NUM("run", a, 1);
+  lval_del(a);
+  lcoro_thread* t = lcoro_self();
+  /* Resumes in a row that only waited, since channels were last seen */
+  int idle = 0;
+  uint64_t seen = lchan_events();
+  while (t->count) {
+    if (idle >= t->count) {
+      lchan_sleep(seen);
+      idle = 0;
+      seen = lchan_events();
+    }
+    lval* c = lcoro_ready_pop(t);
+    t->blocked = 0;
+    /* Saved for a run inside one of the coroutines */
+    lcoro* outer = t->scheduled;
+    t->scheduled = c->coro;
+    lval* x = lcoro_resume(e, c->coro, lval_sexpr());
+    t->scheduled = outer;
+    if (t->blocked) {
+      idle++;
+    } else {
+      idle = 0;
+      seen = lchan_events();
+    }
+    if (x->type == LVAL_ERR) { lval_println(x); }
+    lval_del(x);
+    if (lcoro_state(c->coro) == LCORO_SUSPENDED) {
+      lcoro_ready_push(t, c);
+    } else {
+      lval_del(c);
+    }
+  }
+  return lval_sexpr();
+}
+
+/* Channels. A ring of slots, each with a sequence number saying whose turn it 
+     is: the sender that claims its position, while it is twice the position, 
+     or the receiver, once it is one more than that. Doubling keeps a slot 
+     still full from one lap apart from one free for the next, even in a ring 
+     of a single slot. Senders and receivers claim positions by 
+     compare-and-swap, so neither takes a lock. A value sent is handed over as 
+     it is, not copied, after detaching what it shares with values left on the 
+     sending thread. Waiting, for room or for a value, yields inside a 
+     coroutine run is scheduling, so green threads can pass values through 
+     channels. Elsewhere the thread sleeps until a channel changes, running no 
+     pool tasks meanwhile, as the one it ran could be the very sender it waits 
+     for. So futures that wait on each other through channels want a pool 
+     thread each */
+
+/* Most values a channel can hold */
+#define LCHAN_MAX (1 << 24)
+
+typedef struct {
+  uint64_t seq;
+  lval* v;
+} lslot;
+
+struct lchan {
+  uint64_t refs;
+  uint64_t size;
+  lslot* slots;
+  /* Next positions to send to and to receive from */
+  uint64_t head;
+  uint64_t tail;
+};
+
+/* Shared by every channel: sleepers are woken whenever any changes, so that 
+     select-chan can wait on several */
+struct {
+  uint64_t events;
+  uint64_t sleepers;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+} lchans = { 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+lval* lval_chan(lchan* c) {
+  lval* v = lval_new(LVAL_CHAN);
+  v->chan = c;
+  return v;
+}
+
+lchan* lchan_new(uint64_t size) {
+  lchan* c = malloc(sizeof(lchan));
+  c->refs = 1;
+  c->size = size;
+  c->slots = malloc(sizeof(lslot) * size);
+  for (uint64_t i = 0; i < size; i++) {
+    c->slots[i].seq = 2 * i;
+    c->slots[i].v = NULL;
+  }
+  c->head = 0;
+  c->tail = 0;
+  return c;
+}
+
+/* Put v in c if there is room, taking it */
+int lchan_put(lchan* c, lval* v) {
+  uint64_t pos = latomic_load(&c->head);
+  for (;;) {
+    lslot* s = &c->slots[pos % c->size];
+    uint64_t seq = latomic_load(&s->seq);
+    if (seq == 2 * pos) {
+      if (latomic_cas(&c->head, &pos, pos + 1)) {
+        s->v = v;
+        latomic_store(&s->seq, 2 * pos + 1);
+        return 1;
+      }
+    } else if (seq < 2 * pos) {
+      /* Still holds what was sent a lap ago */
+      return 0;
+    } else {
+      pos = latomic_load(&c->head);
+    }
+  }
+}
+
+/* Oldest value in c, taken out, or NULL if it is empty */
+lval* lchan_take(lchan* c) {
+  uint64_t pos = latomic_load(&c->tail);
+  for (;;) {
+    lslot* s = &c->slots[pos % c->size];
+    uint64_t seq = latomic_load(&s->seq);
+    if (seq == 2 * pos + 1) {
+      if (latomic_cas(&c->tail, &pos, pos + 1)) {
+        lval* v = s->v;
+        latomic_store(&s->seq, 2 * (pos + c->size));
+        return v;
+      }
+    } else if (seq < 2 * pos + 1) {
+      return NULL;
+    } else {
+      pos = latomic_load(&c->tail);
+    }
+  }
+}
+
+void lchan_retain(lchan* c) {
+  latomic_add(&c->refs, 1);
+}
+
+void lchan_release(lchan* c) {
+  if (latomic_add(&c->refs, -1) != 0) { return; }
+  lval* v;
+  while ((v = lchan_take(c))) { lval_del(v); }
+  free(c->slots);
+  free(c);
+}
+
+/* Wake those waiting on channels, after one has changed */
+void lchan_changed(void) {
+  latomic_add(&lchans.events, 1);
+  if (latomic_add(&lchans.sleepers, 0)) {
+    pthread_mutex_lock(&lchans.lock);
+    pthread_cond_broadcast(&lchans.changed);
+    pthread_mutex_unlock(&lchans.lock);
+  }
+}
+
+/* Changes made to channels so far, to wait for the next */
+uint64_t lchan_events(void) {
+  return latomic_add(&lchans.events, 0);
+}
+
+/* Sleep until channels change, seen being lchan_events() when they were last 
+     looked at */
+void lchan_sleep(uint64_t seen) {
+  /* A change made between counting this thread in and checking events is 
+       seen here; one made after, by a thread that then sees it counted and 
+       takes the lock to wake it, which it can't do until this one waits */
+  pthread_mutex_lock(&lchans.lock);
+  latomic_add(&lchans.sleepers, 1);
+  while (latomic_add(&lchans.events, 0) == seen) {
+    pthread_cond_wait(&lchans.changed, &lchans.lock);
+  }
+  latomic_add(&lchans.sleepers, -1);
+  pthread_mutex_unlock(&lchans.lock);
+}
+
+/* Wait for a channel to change, as lchan_sleep. Inside a coroutine run 
+     resumed, yields to run instead, returning an error if the coroutine is 
+     deleted meanwhile. Any other resume is waiting for a value the coroutine 
+     yields, not for it to wait, so there the thread sleeps */
+lval* lchan_wait(uint64_t seen) {
+  lcoro_thread* t = lcoro_self();
+  if (t->current && t->current == t->scheduled) {
+    t->blocked = 1;
+    lval* x = lcoro_yield(t->current, lval_sexpr());
+    if (x->type == LVAL_ERR) { return x; }
+    lval_del(x);
+    return NULL;
+  }
+  lchan_sleep(seen);
+  return NULL;
+}
+
+/* Make v, which the caller holds the only copy of, share nothing unguarded 
+     with values left on this thread, so it can be used on another. Data is 
+     left as it is. Symbols let go of their lookup caches, and functions, 
+     whose bodies and caches copies share, are cloned */
+lval* lval_detach(lval* v) {
+  switch (v->type) {
+    case LVAL_SYM:
+      if (v->site && --v->site->refs == 0) { free(v->site); }
+      v->site = NULL;
+      break;
+    case LVAL_FUN:
+      if (!v->builtin) {
+        lval* x = lval_clone(v);
+        lval_del(v);
+        return x;
+      }
+      break;
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+      for (int i = 0; i < v->count; i++) { v->cell[i] = lval_detach(v->cell[i]); }
+      if (v->folded) { v->folded = lval_detach(v->folded); }
+      break;
+  }
+  return v;
+}
+
+/* (chan n): a channel holding up to n values at once */
+lval* builtin_chan(lenv* e, lval* a) {
+  LASSERT_NUM("chan", a, 1);
+  LASSERT_TYPE("chan", a, 0, LVAL_NUM);
+  long n = a->cell[0]->num;
+  LASSERT(a, n >= 1 && n <= LCHAN_MAX,
+    "Function 'chan' passed size %li. Expected 1 to %i.", n, LCHAN_MAX);
+  lval_del(a);
+  return lval_chan(lchan_new(n));
+}
+
+/* (send c x): put x in c, waiting until there is room */
+lval* builtin_send(lenv* e, lval* a) {
+  LASSERT_NUM("send", a, 2);
+  LASSERT_TYPE("send", a, 0, LVAL_CHAN);
+  lval* v = lval_detach(lval_pop(a, 1));
+  lchan* c = a->cell[0]->chan;
+  for (;;) {
+    uint64_t seen = lchan_events();
+    if (lchan_put(c, v)) { break; }
+    lval* err = lchan_wait(seen);
+    if (err) {
+      lval_del(v);
+      lval_del(a);
+      return err;
+    }
+  }
+  lchan_changed();
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/* (recv c): the oldest value in c, taken out, waiting until there is one */
+lval* builtin_recv(lenv* e, lval* a) {
+  LASSERT_NUM("recv", a, 1);
+  LASSERT_TYPE("recv", a, 0, LVAL_CHAN);
+  lchan* c = a->cell[0]->chan;
+  lval* v;
+  for (;;) {
+    uint64_t seen = lchan_events();
+    if ((v = lchan_take(c))) { break; }
+    lval* err = lchan_wait(seen);
+    if (err) {
+      lval_del(a);
+      return err;
+    }
+  }
+  lchan_changed();
+  lval_del(a);
+  return v;
+}
+
+/* (select-chan c & cs): {c x}, x being a value taken from whichever of the 
+     channels first has one. They are tried starting from a different one 
+     each time, so none is starved */
+lval* builtin_select_chan(lenv* e, lval* a) {
+  LASSERT(a, a->count >= 1, "Function 'select-chan' passed no channels.");
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("select-chan", a, i, LVAL_CHAN);
+  }
+  static uint64_t turn;
+  int first = lcount_next(&turn) % a->count;
+  for (;;) {
+    uint64_t seen = lchan_events();
+    for (int i = 0; i < a->count; i++) {
+      int j = (first + i) % a->count;
+      lval* v = lchan_take(a->cell[j]->chan);
+      if (v == NULL) { continue; }
+      lchan_changed();
+      lval* x = lval_add(lval_qexpr(), lval_pop(a, j));
+      lval_del(a);
+      return lval_add(x, v);
+    }
+    lval* err = lchan_wait(seen);
+    if (err) {
+      lval_del(a);
+      return err;
+    }
+  }
+}
+
+/* Threaded code. Once a user-defined function has been called LPROG_CALLS 
+     times its body is compiled to a short list of steps on a stack of values, 
+     which run without copying or walking the body again. Each step ends by 
+     jumping straight to the handler of the next, through its address where 
+     the compiler can take addresses of labels (GCC and Clang), and through a 
+     switch otherwise or if LPROG_SWITCH is defined. Evaluation is the same as 
+     lval_eval_sexpr's: an 'if' with literal branches runs the branch taken in 
+     line, if 'if' is still the builtin when it runs, and values folded when 
+     the function was defined are used while they still hold */
+
+#if defined(__GNUC__) && !defined(LPROG_SWITCH)
+#define LPROG_THREADED
+#endif
+
+enum { LOP_CONST, LOP_SYM, LOP_CALL, LOP_IF, LOP_JUMP, LOP_FOLD, LOP_RET, LOP_COUNT };
+
+/* Addresses of the handlers, by step, fetched once by lprog_init */
+void** lprog_labels = NULL;
+
+lprog* lprog_new(void) {
+  lprog* p = calloc(1, sizeof(lprog));
+  p->refs = 1;
+  return p;
+}
+
+void lprog_del(lprog* p) {
+  if (--p->refs > 0) { return; }
+  if (p->body) { lval_del(p->body); }
+  for (int i = 0; i < p->nconsts; i++) { lval_del(p->consts[i]); }
+  free(p->consts);
+  free(p->ops);
+  free(p);
+}
+
+/* Add a step, returning its index */
+int lprog_emit(lprog* p, int op, int a) {
+  p->ops = realloc(p->ops, sizeof(lop) * (p->count + 1));
+  lop* o = &p->ops[p->count];
+  o->label = NULL;
+  o->op = op;
+  o->a = a;
+  o->b = 0;
+  return p->count++;
+}
+
+/* Add a constant (taking v), returning its index */
+int lprog_const(lprog* p, lval* v) {
+  p->consts = realloc(p->consts, sizeof(lval*) * (p->nconsts + 1));
+  p->consts[p->nconsts] = v;
+  return p->nconsts++;
+}
+
+/* Note d values on the stack */
+void lprog_depth(lprog* p, int d) {
+  if (d > p->depth) { p->depth = d; }
+}
+
+void lprog_sexpr(lprog* p, lval* v, int d);
+
+/* Steps leaving the value of x on top of d values */
+void lprog_expr(lprog* p, lval* x, int d) {
+  lprog_depth(p, d + 1);
+  if (x->type == LVAL_SEXPR) {
+    lprog_sexpr(p, x, d);
+  } else if (x->type == LVAL_SYM) {
+    /* The copy shares the symbol's lookup cache */
+    lprog_emit(p, LOP_SYM, lprog_const(p, lval_copy(x)));
+  } else {
+    lprog_emit(p, LOP_CONST, lprog_const(p, lval_copy(x)));
+  }
+}
+
+/* Steps leaving the value of the cells of v, evaluated as an Sexpr, on top of 
+     d values */
+void lprog_sexpr(lprog* p, lval* v, int d) {
+  /* Folded value first, passing over the rest while it holds */
+  int fold = -1;
+  if (v->folded && v->epoch == lcount_get(&lpure_epoch)) {
+    fold = lprog_emit(p, LOP_FOLD, lprog_const(p, lval_copy(v->folded)));
+  }
+  
+  lval** cells = v->cell;
+  if (v->count == 0) {
+    lprog_emit(p, LOP_CONST, lprog_const(p, lval_sexpr()));
+  } else if (v->count == 1) {
+    lprog_expr(p, cells[0], d);
+  } else if (v->count == 4 && cells[0]->type == LVAL_SYM && strcmp(cells[0]->sym, "if") == 0
+    && cells[2]->type == LVAL_QEXPR && cells[3]->type == LVAL_QEXPR) {
+    lprog_expr(p, cells[0], d);
+    lprog_expr(p, cells[1], d + 1);
+    int branch = lprog_emit(p, LOP_IF, 0);
+    lprog_sexpr(p, cells[2], d);
+    int then_end = lprog_emit(p, LOP_JUMP, 0);
+    p->ops[branch].a = p->count;
+    lprog_sexpr(p, cells[3], d);
+    int else_end = lprog_emit(p, LOP_JUMP, 0);
+    /* Otherwise the call, as if not compiled */
+    p->ops[branch].b = p->count;
+    lprog_expr(p, cells[2], d + 2);
+    lprog_expr(p, cells[3], d + 3);
+    lprog_emit(p, LOP_CALL, 4);
+    p->ops[then_end].a = p->count;
+    p->ops[else_end].a = p->count;
+  } else {
+    for (int i = 0; i < v->count; i++) { lprog_expr(p, cells[i], d + i); }
+    lprog_emit(p, LOP_CALL, v->count);
+  }
+  
+  if (fold != -1) { p->ops[fold].b = p->count; }
+}
+
+lval* lprog_run(lenv* e, lprog* p);
+
+void lprog_init(void) {
+#ifdef LPROG_THREADED
+  lprog_run(NULL, NULL);
+#endif
+}
+
+/* Compile a function body, which the program takes */
+void lprog_compile(lprog* p, lval* body) {
+  p->body = body;
+  p->epoch = lcount_get(&lpure_epoch);
+  p->depth = 1;
+  lprog_sexpr(p, body, 0);
+  lprog_emit(p, LOP_RET, 0);
+  
+#ifdef LPROG_THREADED
+  for (int i = 0; i < p->count; i++) { p->ops[i].label = lprog_labels[p->ops[i].op]; }
+#endif
+}
+
+#ifdef LPROG_THREADED
+#define LPROG_OP(name) op_##name:
+#define LPROG_NEXT() goto *ip->label
+#else
+#define LPROG_OP(name) case LOP_##name:
+#define LPROG_NEXT() goto next
+#endif
+
+/* Run a compiled body in the environment its arguments are bound in */
+lval* lprog_run(lenv* e, lprog* p) {
+#ifdef LPROG_THREADED
+  static void* labels[LOP_COUNT] = {
+    &&op_CONST, &&op_SYM, &&op_CALL, &&op_IF, &&op_JUMP, &&op_FOLD, &&op_RET
+  };
+  /* Asked only for the handlers */
+  if (p == NULL) {
+    lprog_labels = labels;
+    return NULL;
+  }
+#endif
+  
+  lval* stack[p->depth];
+  lval** sp = stack;
+  lop* ip = p->ops;
+  
+#ifdef LPROG_THREADED
+  LPROG_NEXT();
+#else
+  next:
+  switch (ip->op) {
+#endif
+  
+  LPROG_OP(CONST) {
+    *sp++ = lval_copy(p->consts[ip->a]);
+    ip++;
+    LPROG_NEXT();
+  }
+  LPROG_OP(SYM) {
+    *sp++ = lenv_get(e, p->consts[ip->a]);
+    ip++;
+    LPROG_NEXT();
+  }
+  LPROG_OP(CALL) {
+    /* The top ip->a values are the Sexpr's children */
+    lval* v = lval_sexpr();
+    v->count = ip->a;
+    v->cell = malloc(sizeof(lval*) * v->count);
+    sp -= v->count;
+    memcpy(v->cell, sp, sizeof(lval*) * v->count);
+    *sp++ = lval_eval_call(e, v);
+    ip++;
+    LPROG_NEXT();
+  }
+  LPROG_OP(IF) {
+    /* Function and condition on top; run the branch, or make the call */
+    lval* f = sp[-2];
+    lval* c = sp[-1];
+    if (f->type != LVAL_FUN || f->builtin != builtin_if
+      || (c->type != LVAL_NUM && c->type != LVAL_DOUBLE)) {
+      ip = p->ops + ip->b;
+      LPROG_NEXT();
+    }
+    ip = c->num ? ip + 1 : p->ops + ip->a;
+    lval_del(f);
+    lval_del(c);
+    sp -= 2;
+    LPROG_NEXT();
+  }
+  LPROG_OP(JUMP) {
+    ip = p->ops + ip->a;
+    LPROG_NEXT();
+  }
+  LPROG_OP(FOLD) {
+    if (p->epoch != lcount_get(&lpure_epoch) || e->shadows) {
+      ip++;
+      LPROG_NEXT();
+    }
+    *sp++ = lval_copy(p->consts[ip->a]);
+    ip = p->ops + ip->b;
+    LPROG_NEXT();
+  }
+  LPROG_OP(RET) {
+    return sp[-1];
+  }
+  
+#ifndef LPROG_THREADED
+  }
+  return NULL;
+#endif
+}
+
+/* Prints data from running programs */
+lval* builtin_print(lenv* e, lval* a) {
+  for (int i = 0; i < a->count; i++) {
+    lval_print(a->cell[i]);
+    putchar(' ');
+  }
+  
+  putchar('\n');
+  lval_del(a);
+  
+  return lval_sexpr();
+}
+
+/* Prints errors */
+lval* builtin_error(lenv* e, lval* a) {
+  /* Check if it passes in a single string arguement */
+  LASSERT_NUM("error", a, 1);
+  LASSERT_TYPE("error", a, 0, LVAL_STR);
+  
+  lval* err = lval_err(a->cell[0]->str);
+  
+  lval_del(a);
+  return err;
+}
+
+/* Macros */
+/* A macro is a list of rules {pattern template}. A use of it, a list headed by
+     its name, is replaced by the template of the first rule whose pattern
+     matches the rest of the list, with the pattern's symbols replaced by what
+     they matched. Uses are expanded as each top-level expression is loaded or
+     entered, before it is evaluated, so the bodies of functions are expanded
+     once when read rather than each time they run.
+   Macros are kept in the global environment under their name with a leading
+     '#', which no symbol can have. So they are saved in images, and do not hide
+     functions of the same name, which still serve uses no rule matches. Each
+     is kept as {{was} rules}, with what its name was bound to when it was
+     defined, if anything; once the name is bound to something else the macro
+     stands down, and a later def of fun or select is used as written */
+
+/* Most expansions one use may go through */
+#define LMACRO_DEPTH 1000
+
+/* Value bound to sym in the global environment, or NULL. Not a copy */
+lval* lenv_peek(lenv* e, char* sym) {
+  while (e->par) { e = e->par; }
+  for (; e; e = e->shared) {
+    if (!(e->mask & lsym_bit(sym))) { continue; }
+    for (int i = 0; i < e->count; i++) {
+      if (strcmp(e->syms[i], sym) == 0) { return e->vals[i]; }
+    }
+  }
+  return NULL;
+}
+
+/* Rules of the macro called name, or NULL if there is none or it has stood 
+     down */
+lval* lmacro_find(lenv* e, char* name) {
+  char* key = malloc(strlen(name) + 2);
+  key[0] = '#';
+  strcpy(key + 1, name);
+  lval* m = lenv_peek(e, key);
+  free(key);
+  if (m == NULL) { return NULL; }
+  
+  lval* was = m->cell[0];
+  lval* now = lenv_peek(e, name);
+  if (was->count ? !now || !lval_eq(now, was->cell[0]) : now != NULL) { return NULL; }
+  return m->cell[1];
+}
+
+/* Symbols bound by matching a pattern, to copies of what they matched */
+typedef struct {
+  int count;
+  char** syms;
+  lval** vals;
+} lbinds;
+
+void lbinds_add(lbinds* b, char* sym, lval* v) {
+  b->count++;
+  b->syms = realloc(b->syms, sizeof(char*) * b->count);
+  b->vals = realloc(b->vals, sizeof(lval*) * b->count);
+  b->syms[b->count-1] = sym;
+  b->vals[b->count-1] = v;
+}
+
+lval* lbinds_get(lbinds* b, char* sym) {
+  for (int i = 0; i < b->count; i++) {
+    if (strcmp(b->syms[i], sym) == 0) { return b->vals[i]; }
+  }
+  return NULL;
+}
+
+void lbinds_clear(lbinds* b) {
+  for (int i = 0; i < b->count; i++) { lval_del(b->vals[i]); }
+  free(b->syms);
+  free(b->vals);
+}
+
+/* Match the elements of x from i on against pattern p. Symbols in p match
+     anything, '&' followed by a symbol matches the rest as a Q-Expression,
+     Q-Expressions match Q-Expressions element by element, and anything else
+     matches values lval_eq to it */
+int lmacro_match(lval* p, lval* x, int i, lbinds* b) {
+  for (int j = 0; j < p->count; j++, i++) {
+    lval* q = p->cell[j];
+    if (q->type == LVAL_SYM && strcmp(q->sym, "&") == 0) {
+      lval* rest = lval_qexpr();
+      for (; i < x->count; i++) { lval_add(rest, lval_copy(x->cell[i])); }
+      lbinds_add(b, p->cell[j+1]->sym, rest);
+      return 1;
+    }
+    if (i >= x->count) { return 0; }
+    
+    lval* y = x->cell[i];
+    if (q->type == LVAL_SYM) {
+      lbinds_add(b, q->sym, lval_copy(y));
+    } else if (q->type == LVAL_QEXPR) {
+      if (y->type != LVAL_QEXPR || !lmacro_match(q, y, 0, b)) { return 0; }
+    } else if (!lval_eq(q, y)) {
+      return 0;
+    }
+  }
+  return i == x->count;
+}
+
+/* A template with the pattern's symbols replaced, and '& xs' spliced. Symbols
+     marked local by defmacro get the fresh name given */
+lval* lmacro_subst(lval* t, lbinds* b, long name) {
+  if (t->type == LVAL_SYM) {
+    lval* v = lbinds_get(b, t->sym);
+    if (v) { return lval_copy(v); }
+    
+    size_t len = strlen(t->sym);
+    if (len > 1 && t->sym[len-1] == '#') {
+      char* fresh = malloc(len + 24);
+      sprintf(fresh, "%s%li", t->sym, name);
+      lval* x = lval_sym(fresh);
+      free(fresh);
+      return x;
+    }
+    return lval_copy(t);
+  }
+  if (t->type != LVAL_SEXPR && t->type != LVAL_QEXPR) { return lval_copy(t); }
+  
+  lval* x = t->type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+  for (int i = 0; i < t->count; i++) {
+    lval* c = t->cell[i];
+    lval* rest = NULL;
+    if (c->type == LVAL_SYM && strcmp(c->sym, "&") == 0 && i + 1 < t->count
+      && t->cell[i+1]->type == LVAL_SYM) {
+      rest = lbinds_get(b, t->cell[i+1]->sym);
+    }
+    if (rest && rest->type == LVAL_QEXPR) {
+      for (int j = 0; j < rest->count; j++) { lval_add(x, lval_copy(rest->cell[j])); }
+      i++;
+    } else {
+      lval_add(x, lmacro_subst(c, b, name));
+    }
+  }
+  return x;
+}
+
+/* Expansion of a use of a macro, or NULL if v is none, leaving v as it is */
+lval* lmacro_apply(lenv* e, lval* v) {
+  lval* head = v->count ? v->cell[0] : NULL;
+  if (!head || head->type != LVAL_SYM) { return NULL; }
+  
+  lval* rules = lmacro_find(e, head->sym);
+  for (int i = 0; rules && i < rules->count; i++) {
+    lbinds b = { 0, NULL, NULL };
+    if (lmacro_match(rules->cell[i]->cell[0], v, 1, &b)) {
+      lval* x = lmacro_subst(rules->cell[i]->cell[1], &b,
+        lcount_next(&lenv_interp(e)->macro_names));
+      x->type = v->type;
+      lbinds_clear(&b);
+      lval_del(v);
+      return x;
+    }
+    lbinds_clear(&b);
+  }
+  return NULL;
+}
+
+/* Builtins taking code as Q-Expressions, and which of their arguments it is.
+     Other Q-Expressions are data, and left as they are */
+#define LMACRO_BODIES 7
+struct { char* head; int first; int last; } lmacro_bodies[LMACRO_BODIES] = {
+  { "\\", 2, 2 }, { "if", 2, 3 }, { "eval", 1, 1 }, { "while", 1, 2 },
+  { "loop", 1, 1 }, { "dotimes", 3, 3 }, { "for-each", 3, 3 }
+};
+
+/* True if the i-th element of v is evaluated as code */
+int lmacro_code(lval* v, int i) {
+  lval* c = v->cell[i];
+  if (c->type == LVAL_SEXPR) { return 1; }
+  if (c->type != LVAL_QEXPR || v->cell[0]->type != LVAL_SYM) { return 0; }
+  for (int j = 0; j < LMACRO_BODIES; j++) {
+    if (strcmp(v->cell[0]->sym, lmacro_bodies[j].head) == 0) {
+      return i >= lmacro_bodies[j].first && i <= lmacro_bodies[j].last;
+    }
+  }
+  return 0;
+}
+
+/* An expression still to be expanded: where it is held, and how many 
+     expansions led to it */
+typedef struct {
+  lval** slot;
+  int depth;
+} lexpand;
+
+/* Expand the macro uses in an expression about to be evaluated in e. Only
+     what will be evaluated is looked at, and that without recursing, so deeply
+     nested expressions, or data, cost nothing */
+lval* lval_expand(lenv* e, lval* v) {
+  if (v->type != LVAL_SEXPR) { return v; }
+  
+  int count = 1;
+  int cap = 16;
+  lexpand* todo = malloc(sizeof(lexpand) * cap);
+  todo[0].slot = &v;
+  todo[0].depth = 0;
+  while (count) {
+    lexpand t = todo[--count];
+    lval* x;
+    while ((x = lmacro_apply(e, *t.slot))) {
+      *t.slot = x;
+      if (++t.depth > LMACRO_DEPTH) {
+        free(todo);
+        lval_del(v);
+        return lval_err("Macro expansion went deeper than %i.", LMACRO_DEPTH);
+      }
+    }
+    
+    /* Rules are expanded where they are used */
+    x = *t.slot;
+    if (x->count && x->cell[0]->type == LVAL_SYM && strcmp(x->cell[0]->sym, "defmacro") == 0) {
+      continue;
+    }
+    /* Elements last first, so they are expanded in order */
+    for (int i = x->count - 1; i >= 0; i--) {
+      if (!lmacro_code(x, i)) { continue; }
+      if (count == cap) {
+        cap *= 2;
+        todo = realloc(todo, sizeof(lexpand) * cap);
+      }
+      todo[count].slot = &x->cell[i];
+      todo[count].depth = t.depth;
+      count++;
+    }
+  }
+  free(todo);
+  return v;
+}
+
+/* True if '&' in a pattern is only ever followed by a single symbol */
+int lmacro_pattern_ok(lval* p) {
+  for (int i = 0; i < p->count; i++) {
+    lval* q = p->cell[i];
+    if (q->type == LVAL_SYM && strcmp(q->sym, "&") == 0) {
+      return i == p->count - 2 && p->cell[i+1]->type == LVAL_SYM;
+    }
+    if (q->type == LVAL_QEXPR && !lmacro_pattern_ok(q)) { return 0; }
+  }
+  return 1;
+}
+
+/* True if pattern p binds sym */
+int lmacro_binds(lval* p, char* sym) {
+  for (int i = 0; i < p->count; i++) {
+    lval* q = p->cell[i];
+    if (q->type == LVAL_SYM && strcmp(q->sym, sym) == 0) { return 1; }
+    if (q->type == LVAL_QEXPR && lmacro_binds(q, sym)) { return 1; }
+  }
+  return 0;
+}
+
+/* Mark the symbols of template t that are local to an expansion: those that
+     are neither bound by pattern p nor defined now, as values or macros */
+void lmacro_mark(lenv* e, char* name, lval* p, lval* t) {
+  for (int i = 0; i < t->count; i++) {
+    lval* x = t->cell[i];
+    if (x->type == LVAL_SEXPR || x->type == LVAL_QEXPR) {
+      lmacro_mark(e, name, p, x);
+      continue;
+    }
+    if (x->type != LVAL_SYM || strcmp(x->sym, "&") == 0
+      || strcmp(x->sym, name) == 0 || lmacro_binds(p, x->sym)
+      || lenv_peek(e, x->sym) || lmacro_find(e, x->sym)) {
+      continue;
+    }
+    
+    char* local = malloc(strlen(x->sym) + 2);
+    strcpy(local, x->sym);
+    strcat(local, "#");
+    t->cell[i] = lval_sym(local);
+    free(local);
+    lval_del(x);
+  }
+}
+
+/* (defmacro {name} {pattern template}...): define a macro. Symbols a template
+     uses that are neither in its pattern nor defined when the macro is, are
+     local to each expansion and renamed there, so that they cannot capture or
+     be captured by the code around the use */
+lval* builtin_defmacro(lenv* e, lval* a) {
+  LASSERT(a, a->count >= 2,
+    "Function 'defmacro' passed too few arguments. "
+    "Got %i, expected at least 2.", a->count);
+  LASSERT_TYPE("defmacro", a, 0, LVAL_QEXPR);
+  LASSERT(a, a->cell[0]->count == 1 && a->cell[0]->cell[0]->type == LVAL_SYM,
+    "Function 'defmacro' passed incorrect name. Expected a single symbol.");
+  for (int i = 1; i < a->count; i++) {
+    LASSERT_TYPE("defmacro", a, i, LVAL_QEXPR);
+    lval* r = a->cell[i];
+    LASSERT(a, r->count == 2 && r->cell[0]->type == LVAL_QEXPR
+      && r->cell[1]->type == LVAL_QEXPR,
+      "Function 'defmacro' passed incorrect rule. Expected {pattern template}.");
+    LASSERT(a, lmacro_pattern_ok(r->cell[0]),
+      "Function 'defmacro' passed incorrect pattern. "
+      "Symbol '&' not followed by single symbol.");
+  }
+  
+  char* name = a->cell[0]->cell[0]->sym;
+  lval* rules = lval_qexpr();
+  for (int i = 1; i < a->count; i++) {
+    lval* r = lval_copy(a->cell[i]);
+    lmacro_mark(e, name, r->cell[0], r->cell[1]);
+    lval_add(rules, r);
+  }
+  
+  lval* was = lval_qexpr();
+  lval* now = lenv_peek(e, name);
+  if (now) { lval_add(was, lval_copy(now)); }
+  lval* m = lval_add(lval_add(lval_qexpr(), was), rules);
+  
+  char* key = malloc(strlen(name) + 2);
+  key[0] = '#';
+  strcpy(key + 1, name);
+  lval* k = lval_sym(key);
+  lenv_def(e, k, m);
+  lval_del(k);
+  lval_del(m);
+  free(key);
+  
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/* Loads in a file one top-level expression at a time. Each expression is 
+     evaluated and freed before the next is read, so memory use is bounded by 
+     the largest expression rather than the whole file. "-" reads stdin */
+lval* builtin_load_stream(lenv* e, lval* a) {
+  linterp* lisp = lenv_interp(e);
+  char* filename = a->cell[0]->str;
+  int piped = strcmp(filename, "-") == 0;
+  
+  FILE* f = piped ? stdin : fopen(filename, "rb");
+  if (f == NULL) {
+    lval* err = lval_err("Could not load Library %s: error: Unable to open file!", filename);
+    lval_del(a);
+    return err;
+  }
+  
+  mpc_stream_t* s = piped ? mpc_stream_pipe("<stdin>", f) : mpc_stream_file(filename, f);
+  lval* err = NULL;
+  
+  while (!mpc_stream_end(s)) {
+    mpc_result_t r;
+    if (!mpc_stream_parse(s, lisp->Form, &r)) {
+      /* Get parse error as string; earlier expressions have already run */
+      char* err_msg = mpc_err_string(r.error);
+      mpc_err_delete(r.error);
+      err = lval_err("Could not load Library %s", err_msg);
+      free(err_msg);
+      break;
+    }
+    
+    /* Form reads as a list holding at most one expression */
+    lval* expr = lval_read(r.output);
+    mpc_ast_delete(r.output);
+    
+    while (expr->count) {
+      lval* x = lval_eval(e, lval_expand(e, lval_pop(expr, 0)));
+      if (x->type == LVAL_ERR) { lval_println(x); }
+      lval_del(x);
+    }
+    lval_del(expr);
+  }
+  
+  mpc_stream_delete(s);
+  if (!piped) { fclose(f); }
+  lval_del(a);
+  
+  return err ? err : lval_sexpr();
+}
+
+/* Files at least this large are split and parsed on several threads */
+#define LOAD_PARALLEL_MIN (1 << 20)
+/* Smallest piece of a file worth handing to a thread */
+#define LOAD_CHUNK_MIN (1 << 16)
+
+/* A run of whole top-level expressions taken from a file being loaded */
+typedef struct {
+  char* start;
+  size_t len;
+  /* Row of the first line of the chunk within the file */
+  long row;
+  /* Result; either the expressions read or the parse error */
+  lval* expr;
+  mpc_err_t* error;
+} lchunk;
+
+/* Chunks shared between parsing threads; each takes the next unparsed one */
+typedef struct {
+  char* filename;
+  mpc_parser_t* parser;
+  lchunk* chunks;
+  int count;
+  int next;
+  pthread_mutex_t lock;
+} lchunks;
+
+/* Split source into chunks of roughly target bytes. Cuts are only made after 
+     a newline at the top level, never inside an expression, string or comment */
+int lchunks_split(char* src, size_t len, size_t target, lchunk** out) {
+  int count = 0;
+  lchunk* chunks = NULL;
+  int depth = 0, in_str = 0, in_comment = 0;
+  long row = 0, begin_row = 0;
+  size_t begin = 0;
+  
+  for (size_t i = 0; i < len; i++) {
+    char c = src[i];
+    if (in_comment) {
+      if (c == '\n') { in_comment = 0; }
+    } else if (in_str) {
+      /* Skip escaped character, still counting rows */
+      if (c == '\\' && i + 1 < len) { c = src[++i]; }
+      else if (c == '"') { in_str = 0; }
+    } else {
+      switch (c) {
+        case '"': in_str = 1; break;
+        case ';': in_comment = 1; break;
+        case '(': case '{': depth++; break;
+        case ')': case '}': depth--; break;
+      }
+    }
+    
+    if (c != '\n') { continue; }
+    row++;
+    
+    /* Cut after this newline if at the top level and the chunk is big enough */
+    if (!in_str && depth <= 0 && i + 1 - begin >= target) {
+      chunks = realloc(chunks, sizeof(lchunk) * (count + 1));
+      chunks[count++] = (lchunk){ src + begin, i + 1 - begin, begin_row, NULL, NULL };
+      begin = i + 1;
+      begin_row = row;
+    }
+  }
+  
+  /* Remainder of the file */
+  if (begin < len || count == 0) {
+    chunks = realloc(chunks, sizeof(lchunk) * (count + 1));
+    chunks[count++] = (lchunk){ src + begin, len - begin, begin_row, NULL, NULL };
+  }
+  
+  *out = chunks;
+  return count;
+}
+
+/* Thread body; parse and read chunks until none remain */
+void* lchunks_worker(void* arg) {
+  lchunks* j = arg;
+  while (1) {
+    pthread_mutex_lock(&j->lock);
+    int i = j->next++;
+    pthread_mutex_unlock(&j->lock);
+    if (i >= j->count) { return NULL; }
+    
+    lchunk* c = &j->chunks[i];
+    mpc_result_t r;
+    if (mpc_nparse(j->filename, c->start, c->len, j->parser, &r)) {
+      c->expr = lval_read(r.output);
+      mpc_ast_delete(r.output);
+    } else {
+      /* Report the error's position within the whole file */
+      r.error->state.row += c->row;
+      c->error = r.error;
+    }
+  }
+}
+
+/* Read a large file by parsing top-level chunks of it on a pool of threads and 
+     splicing the expressions back together in order. Returns NULL if the file 
+     is small and should be read the ordinary way */
+lval* lval_read_parallel(mpc_parser_t* parser, char* filename, char* src, size_t got) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus < 2 || got < LOAD_PARALLEL_MIN) { return NULL; }
+  
+  /* Several chunks per thread keeps them busy when chunk sizes are uneven */
+  size_t target = got / (cpus * 4);
+  if (target < LOAD_CHUNK_MIN) { target = LOAD_CHUNK_MIN; }
+  
+  lchunks j;
+  j.filename = filename;
+  j.parser = parser;
+  j.count = lchunks_split(src, got, target, &j.chunks);
+  j.next = 0;
+  pthread_mutex_init(&j.lock, NULL);
+  
+  int nthreads = j.count < cpus ? j.count : cpus;
+  pthread_t* threads = malloc(sizeof(pthread_t) * nthreads);
+  for (int i = 0; i < nthreads; i++) {
+    pthread_create(&threads[i], NULL, lchunks_worker, &j);
+  }
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  pthread_mutex_destroy(&j.lock);
+  
+  /* Splice results in order; report the first error, if any */
+  lval* expr = lval_sexpr();
+  for (int i = 0; i < j.count; i++) {
+    lchunk* c = &j.chunks[i];
+    if (c->error && expr->type != LVAL_ERR) {
+      char* err_msg = mpc_err_string(c->error);
+      lval_del(expr);
+      expr = lval_err("Could not load Library %s", err_msg);
+      free(err_msg);
+    }
+    if (c->error) { mpc_err_delete(c->error); continue; }
+    
+    if (expr->type != LVAL_ERR) {
+      expr->cell = realloc(expr->cell, sizeof(lval*) * (expr->count + c->expr->count));
+      memcpy(expr->cell + expr->count, c->expr->cell, sizeof(lval*) * c->expr->count);
+      expr->count += c->expr->count;
+      c->expr->count = 0;
+    }
+    lval_del(c->expr);
+  }
+  free(j.chunks);
+  
+  return expr;
+}
+
+/* Parsed file cache. A file that has been read is saved next to it (foo.lspy 
+     in foo.lspyc) as a compact binary encoding of its expressions, headed by 
+     the file's size, modification time and a hash of its contents. Loading 
+     the unchanged file again decodes that rather than parsing */
+#define LCACHE_MAGIC 0x4C535943 // "LSYC"
+#define LCACHE_VERSION 1
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t size;
+  int64_t mtime;
+  uint64_t hash;
+} lcache_header;
+
+/* Byte buffer the cache is encoded to and decoded from */
+typedef struct {
+  char* data;
+  size_t len;
+  size_t cap;
+  size_t pos;
+} lbuf;
+
+/* FNV-1a hash of a file's contents */
+uint64_t lcache_hash(char* src, size_t len) {
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)src[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+void lbuf_put(lbuf* b, void* x, size_t n) {
+  if (b->len + n > b->cap) {
+    while (b->len + n > b->cap) { b->cap = b->cap ? b->cap * 2 : 4096; }
+    b->data = realloc(b->data, b->cap);
+  }
+  memcpy(b->data + b->len, x, n);
+  b->len += n;
+}
+
+int lbuf_get(lbuf* b, void* x, size_t n) {
+  if (b->len - b->pos < n) { return 0; }
+  memcpy(x, b->data + b->pos, n);
+  b->pos += n;
+  return 1;
+}
+
+/* Counts and lengths are written 7 bits at a time, so most take one byte */
+void lbuf_put_count(lbuf* b, size_t n) {
+  unsigned char c;
+  do {
+    c = n & 0x7F;
+    n >>= 7;
+    if (n) { c |= 0x80; }
+    lbuf_put(b, &c, 1);
+  } while (n);
+}
+
+int lbuf_get_count(lbuf* b, size_t* n) {
+  unsigned char c;
+  int shift = 0;
+  *n = 0;
+  do {
+    if (shift > 56 || !lbuf_get(b, &c, 1)) { return 0; }
+    *n |= (size_t)(c & 0x7F) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  return 1;
+}
+
+void lbuf_put_str(lbuf* b, char* s) {
+  size_t n = strlen(s);
+  lbuf_put_count(b, n);
+  lbuf_put(b, s, n);
+}
+
+/* Returns a new string, or NULL if the buffer is cut short */
+char* lbuf_get_str(lbuf* b) {
+  size_t n;
+  if (!lbuf_get_count(b, &n) || b->len - b->pos < n) { return NULL; }
+  char* s = malloc(n + 1);
+  lbuf_get(b, s, n);
+  s[n] = '\0';
+  return s;
+}
+
+void lbuf_put_env(lbuf* b, lenv* e, lenv* builtins);
+lenv* lbuf_get_env(lbuf* b, lenv* builtins);
+
+/* Name a builtin is registered under in an environment of builtins */
+char* lbuiltin_name(lenv* builtins, lbuiltin f) {
+  for (int i = 0; i < builtins->count; i++) {
+    if (builtins->vals[i]->builtin == f) { return builtins->syms[i]; }
+  }
+  return "";
+}
+
+/* Encode a value. Builtin functions are written by name and relinked against 
+     an environment of builtins when read back; expressions read from a file 
+     contain none, so the cache passes NULL */
+void lbuf_put_lval(lbuf* b, lval* v, lenv* builtins) {
+  /* Saved as its value, as it will be once awaited */
+  if (v->type == LVAL_FUTURE) {
+    lval* x = lfuture_await(v->future);
+    lbuf_put_lval(b, x, builtins);
+    lval_del(x);
+    return;
+  }
+  /* Where it had got to, or who else holds it, can't be saved */
+  if (v->type == LVAL_CORO || v->type == LVAL_CHAN) {
+    lval* x = lval_err(v->type == LVAL_CORO ? "Coroutine not saved in image."
+      : "Channel not saved in image.");
+    lbuf_put_lval(b, x, builtins);
+    lval_del(x);
+    return;
+  }
+  /* Saved as the function with the arguments bound, as it once was */
+  if (v->type == LVAL_FUN && v->part) {
+    lval* fn = lpart_apply(lval_copy(v));
+    lbuf_put_lval(b, fn, builtins);
+    lval_del(fn);
+    return;
+  }
+  unsigned char type = v->type;
+  lbuf_put(b, &type, 1);
+  switch (v->type) {
+    case LVAL_NUM:
+    case LVAL_DOUBLE: lbuf_put(b, &v->num, sizeof(double)); break;
+    case LVAL_ERR: lbuf_put_str(b, v->err); break;
+    case LVAL_SYM: lbuf_put_str(b, v->sym); break;
+    case LVAL_STR: lbuf_put_str(b, v->str); break;
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+      lbuf_put_count(b, v->count);
+      for (int i = 0; i < v->count; i++) { lbuf_put_lval(b, v->cell[i], builtins); }
+      break;
+    case LVAL_FUN:
+      if (v->builtin) {
+        lbuf_put_count(b, 0);
+        lbuf_put_str(b, lbuiltin_name(builtins, v->builtin));
+      } else {
+        /* A memoised function keeps how it caches, but none of the results */
+        lbuf_put_count(b, v->memo ? 2 : 1);
+        if (v->memo) {
+          unsigned char policy = v->memo->policy;
+          lbuf_put_count(b, v->memo->limit);
+          lbuf_put(b, &policy, 1);
+        }
+        lbuf_put_env(b, v->env, builtins);
+        lbuf_put_lval(b, v->formals, builtins);
+        lbuf_put_lval(b, v->body, builtins);
+      }
+      break;
+  }
+}
+
+/* Decode a value; NULL if the encoding is damaged */
+lval* lbuf_get_lval(lbuf* b, lenv* builtins) {
+  unsigned char type;
+  if (!lbuf_get(b, &type, 1)) { return NULL; }
+  
+  lval* v = NULL;
+  char* s;
+  double num;
+  size_t count;
+  switch (type) {
+    case LVAL_NUM:
+    case LVAL_DOUBLE:
+      if (!lbuf_get(b, &num, sizeof(double))) { return NULL; }
+      v = type == LVAL_NUM ? lval_num(0) : lval_double(0);
+      v->num = num;
+      return v;
+    case LVAL_ERR:
+    case LVAL_SYM:
+    case LVAL_STR:
+      if (!(s = lbuf_get_str(b))) { return NULL; }
+      if (type == LVAL_ERR) { v = lval_err("%s", s); }
+      if (type == LVAL_SYM) { v = lval_sym(s); }
+      if (type == LVAL_STR) { v = lval_str(s); }
+      free(s);
+      return v;
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+      /* Every element takes at least a byte */
+      if (!lbuf_get_count(b, &count) || count > b->len - b->pos) { return NULL; }
+      v = type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+      v->cell = malloc(sizeof(lval*) * count);
+      for (size_t i = 0; i < count; i++) {
+        lval* x = lbuf_get_lval(b, builtins);
+        if (x == NULL) { lval_del(v); return NULL; }
+        v->cell[v->count++] = x;
+      }
+      return v;
+    case LVAL_FUN:
+      if (builtins == NULL || !lbuf_get_count(b, &count)) { return NULL; }
+      if (count == 0) {
+        if (!(s = lbuf_get_str(b))) { return NULL; }
+        lval* k = lval_sym(s);
+        v = lenv_get(builtins, k);
+        lval_del(k);
+        free(s);
+        if (v->type != LVAL_FUN) { lval_del(v); return NULL; }
+        return v;
+      }
+      size_t limit = 0;
+      unsigned char policy = LMEMO_LRU;
+      if (count > 2 || (count == 2 && (!lbuf_get_count(b, &limit)
+        || !lbuf_get(b, &policy, 1) || (policy != LMEMO_LRU && policy != LMEMO_FIFO)))) {
+        return NULL;
+      }
+      lenv* env = lbuf_get_env(b, builtins);
+      if (env == NULL) { return NULL; }
+      lval* formals = lbuf_get_lval(b, builtins);
+      lval* body = formals ? lbuf_get_lval(b, builtins) : NULL;
+      if (body == NULL) {
+        lenv_del(env);
+        if (formals) { lval_del(formals); }
+        return NULL;
+      }
+      v = lval_lambda(formals, body);
+      lenv_del(v->env);
+      v->env = env;
+      if (count == 2) { v->memo = lmemo_new(limit, policy); }
+      return v;
+  }
+  return NULL;
+}
+
+/* Encode the bindings of an environment, but not its parent */
+void lbuf_put_env(lbuf* b, lenv* e, lenv* builtins) {
+  lbuf_put_count(b, e->count);
+  for (int i = 0; i < e->count; i++) {
+    lbuf_put_str(b, e->syms[i]);
+    lbuf_put_lval(b, e->vals[i], builtins);
+  }
+}
+
+lenv* lbuf_get_env(lbuf* b, lenv* builtins) {
+  size_t count;
+  /* Every binding takes at least two bytes */
+  if (!lbuf_get_count(b, &count) || count > b->len - b->pos) { return NULL; }
+  
+  lenv* e = lenv_new();
+  e->syms = malloc(sizeof(char*) * count);
+  e->vals = malloc(sizeof(lval*) * count);
+  for (size_t i = 0; i < count; i++) {
+    char* sym = lbuf_get_str(b);
+    lval* val = sym ? lbuf_get_lval(b, builtins) : NULL;
+    if (val == NULL) {
+      free(sym);
+      lenv_del(e);
+      return NULL;
+    }
+    e->syms[e->count] = sym;
+    e->vals[e->count] = val;
+    e->mask |= lsym_bit(sym);
+    if (lpure_rebinds(sym, lsym_bit(sym), val)) {
+      e->rebinds = 1;
+      lcount_next(&lpure_epoch);
+    }
+    e->count++;
+  }
+  return e;
+}
+
+/* Name of the cache file kept for a source file */
+char* lcache_path(char* filename) {
+  char* path = malloc(strlen(filename) + 2);
+  strcpy(path, filename);
+  strcat(path, "c");
+  return path;
+}
+
+/* Header a cache must have to be valid for the given file */
+lcache_header lcache_header_for(struct stat* st, char* src, size_t len) {
+  lcache_header h;
+  memset(&h, 0, sizeof(h));
+  h.magic = LCACHE_MAGIC;
+  h.version = LCACHE_VERSION;
+  h.size = st->st_size;
+  h.mtime = st->st_mtime;
+  h.hash = lcache_hash(src, len);
+  return h;
+}
+
+/* Expressions cached for a file, or NULL if there are none or they are stale */
+lval* lcache_load(char* filename, lcache_header* want) {
+  char* path = lcache_path(filename);
+  FILE* f = fopen(path, "rb");
+  free(path);
+  if (f == NULL) { return NULL; }
+  
+  lbuf b = { NULL, 0, 0, 0 };
+  char chunk[4096];
+  size_t got;
+  while ((got = fread(chunk, 1, sizeof(chunk), f)) > 0) { lbuf_put(&b, chunk, got); }
+  fclose(f);
+  
+  lcache_header h;
+  lval* expr = NULL;
+  if (lbuf_get(&b, &h, sizeof(h)) && memcmp(&h, want, sizeof(h)) == 0) {
+    expr = lbuf_get_lval(&b, NULL);
+    /* Anything left over means the file is not what it claims */
+    if (expr && (expr->type != LVAL_SEXPR || b.pos != b.len)) {
+      lval_del(expr);
+      expr = NULL;
+    }
+  }
+  free(b.data);
+  return expr;
+}
+
+/* Save the expressions read from a file. Written to a temporary file and 
+     renamed so that a concurrent load never sees half a cache. Failure (such 
+     as a read-only directory) just means there is no cache */
+void lcache_save(char* filename, lcache_header* h, lval* expr) {
+  lbuf b = { NULL, 0, 0, 0 };
+  lbuf_put(&b, h, sizeof(lcache_header));
+  lbuf_put_lval(&b, expr, NULL);
+  
+  char* path = lcache_path(filename);
+  /* Unique to the thread as well as the process, as interpreters on several 
+       threads may save the same file */
+  static uint64_t saves = 0;
+  char* tmp = malloc(strlen(path) + 48);
+  sprintf(tmp, "%s.%ld.%llu", path, (long)getpid(), (unsigned long long)lcount_next(&saves));
+  
+  FILE* f = fopen(tmp, "wb");
+  if (f) {
+    int ok = fwrite(b.data, 1, b.len, f) == b.len;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp, path) != 0) { remove(tmp); }
+  }
+  
+  free(tmp);
+  free(path);
+  free(b.data);
+}
+
+/* Parse and read a whole file into a list of its top-level expressions */
+lval* lval_read_file(linterp* lisp, char* filename) {
+  /* Read the whole file in; anything that is not a readable regular file is 
+       left to mpc, which reports why */
+  struct stat st;
+  FILE* f = NULL;
+  if (stat(filename, &st) == 0 && S_ISREG(st.st_mode)) { f = fopen(filename, "rb"); }
+  
+  mpc_result_t r;
+  if (f == NULL) {
+    if (mpc_parse_contents(filename, lisp->Lispy, &r)) {
+      lval* expr = lval_read(r.output);
+      mpc_ast_delete(r.output);
+      return expr;
+    }
+  } else {
+    char* src = malloc(st.st_size + 1);
+    size_t len = fread(src, 1, st.st_size, f);
+    src[len] = '\0';
+    fclose(f);
+    
+    lcache_header h;
+    if (lisp->load_caching) {
+      h = lcache_header_for(&st, src, len);
+      lval* expr = lcache_load(filename, &h);
+      if (expr) { free(src); return expr; }
+    }
+    
+    lval* expr = lval_read_parallel(lisp->Lispy, filename, src, len);
+    if (expr == NULL && mpc_nparse(filename, src, len, lisp->Lispy, &r)) {
+      expr = lval_read(r.output);
+      mpc_ast_delete(r.output);
+    }
+    free(src);
+    
+    if (expr) {
+      if (lisp->load_caching && expr->type != LVAL_ERR) { lcache_save(filename, &h, expr); }
+      return expr;
+    }
+  }
   
-  lval* err = lval_err(a->cell[0]->str);
+  /* Get parse error as string */
+  char* err_msg = mpc_err_string(r.error);
+  mpc_err_delete(r.error);
   
-  lval_del(a);
+  lval* err = lval_err("Could not load Library %s", err_msg);
+  free(err_msg);
   return err;
 }
 
@@ -1099,42 +4930,150 @@ lval* builtin_load(lenv* e, lval* a) {
   LASSERT_NUM("load", a, 1);
   LASSERT_TYPE("load", a, 0, LVAL_STR);
   
-  /* Parse file given by string name; gives us an abstract syntax tree */
-  mpc_result_t r;
-  if (mpc_parse_contents(a->cell[0]->str, Lispy, &r)) {
-    /* Read contents; there are multiple expressions that can be evaluated separatedly */
-    lval* expr = lval_read(r.output);
-    mpc_ast_delete(r.output);
-    
-    /* Evaluate each expression */
-    while (expr->count) {
-      lval* x = lval_eval(e, lval_pop(expr, 0));
-      if (x->type == LVAL_ERR) { lval_println(x); }
-      lval_del(x);
-    }
-    
-    lval_del(expr);
-    lval_del(a);
-    
-    return lval_sexpr(); // Empty list
-    
-  } else {
-    /* Get parse error as string */
-    char* err_msg = mpc_err_string(r.error);
-    mpc_err_delete(r.error);
-    
-    lval* err = lval_err("Could not load Library %s", err_msg);
-    free(err_msg);
-    lval_del(a);
-    
-    return err;
+  linterp* lisp = lenv_interp(e);
+  if (lisp->load_streaming || strcmp(a->cell[0]->str, "-") == 0) {
+    return builtin_load_stream(e, a);
+  }
+  
+  /* Read contents; there are multiple expressions that can be evaluated separatedly */
+  lval* expr = lval_read_file(lisp, a->cell[0]->str);
+  lval_del(a);
+  if (expr->type == LVAL_ERR) { return expr; }
+  
+  /* Evaluate each expression in order. Indexing rather than popping from the 
+       front keeps this linear in the number of expressions */
+  for (int i = 0; i < expr->count; i++) {
+    lval* x = lval_eval(e, lval_expand(e, expr->cell[i]));
+    if (x->type == LVAL_ERR) { lval_println(x); }
+    lval_del(x);
+  }
+  
+  /* Every expression was consumed by lval_eval */
+  expr->count = 0;
+  lval_del(expr);
+  
+  return lval_sexpr(); // Empty list
+}
+
+/* Compiled libraries. lisp --compile turns a file into C (see lcomp_file) 
+     calling back into the interpreter through the functions below, along with 
+     the constructors and the builtins. Built into a shared object, the file is 
+     loaded with load-native, which needs the interpreter to have been linked 
+     with -rdynamic so the library can find them */
+#define LNATIVE_ABI 2
+
+/* Constants of a compiled library, as made for one interpreter. They hold the
+     lookup caches of the library's symbols, which are only ever used by the 
+     interpreter's own thread, and the bodies of the functions it defines */
+typedef struct lnative {
+  int* lib;       /* the library's lnative_abi, telling it from the others */
+  int count;
+  lval** consts;
+} lnative;
+
+/* Constants of library lib for the interpreter of e, made by init the first 
+     time it is loaded there */
+lval** lnative_consts(lenv* e, int* lib, int count, void (*init)(lenv*, lval**)) {
+  linterp* lisp = lenv_interp(e);
+  for (int i = 0; i < lisp->native_count; i++) {
+    if (lisp->natives[i].lib == lib) { return lisp->natives[i].consts; }
+  }
+  
+  lval** consts = calloc(count, sizeof(lval*));
+  init(e, consts);
+  lisp->native_count++;
+  lisp->natives = realloc(lisp->natives, sizeof(lnative) * lisp->native_count);
+  lnative* n = &lisp->natives[lisp->native_count-1];
+  n->lib = lib;
+  n->count = count;
+  n->consts = consts;
+  return consts;
+}
+
+/* Symbol with its lookup cache, resolved now if it names a pure builtin */
+lval* lnative_sym(lenv* e, char* s) {
+  lval* v = lval_sym(s);
+  lval_site(v);
+  lval_fold_sym(e, v);
+  return v;
+}
+
+/* Evaluated children of an Sexpr, given as count further arguments, called as 
+     lval_eval_sexpr would */
+lval* lnative_call(lenv* e, int count, ...) {
+  lval* v = lval_sexpr();
+  v->count = count;
+  v->cell = malloc(sizeof(lval*) * count);
+  va_list va;
+  va_start(va, count);
+  for (int i = 0; i < count; i++) { v->cell[i] = va_arg(va, lval*); }
+  va_end(va);
+  return lval_eval_call(e, v);
+}
+
+/* True if f is the builtin b */
+int lnative_is(lval* f, lbuiltin b) {
+  return f->type == LVAL_FUN && f->builtin == b;
+}
+
+/* Truth of a number as 'if' takes it, or -1 if x is not a number */
+int lnative_truth(lval* x) {
+  if (x->type != LVAL_NUM && x->type != LVAL_DOUBLE) { return -1; }
+  return x->num != 0;
+}
+
+/* Give a function just made by '\' the compiled form of its body. The body 
+     itself is swapped for the constant, which it equals and which lasts as 
+     long as the interpreter does */
+lval* lnative_lambda(lval* f, lcode code, lval* body, lval** consts) {
+  if (f->type == LVAL_FUN && !f->builtin && !f->part) {
+    lval_del(f->body);
+    f->body = body;
+    f->code = code;
+    f->consts = consts;
+  }
+  return f;
+}
+
+/* Dispose of the value of a top-level expression as load does */
+void lnative_result(lval* x) {
+  if (x->type == LVAL_ERR) { lval_println(x); }
+  lval_del(x);
+}
+
+/* Load a compiled library, running its top-level expressions in order. The 
+     library stays loaded, as functions it defined may still be called */
+lval* builtin_load_native(lenv* e, lval* a) {
+  LASSERT_NUM("load-native", a, 1);
+  LASSERT_TYPE("load-native", a, 0, LVAL_STR);
+#ifdef _WIN32
+  LASSERT(a, 0, "Function 'load-native' is not supported on this platform.");
+#else
+  /* A bare name would otherwise be searched for on the library path */
+  char* name = a->cell[0]->str;
+  char* path = malloc(strlen(name) + 3);
+  sprintf(path, "%s%s", strchr(name, '/') ? "" : "./", name);
+  void* lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  free(path);
+  LASSERT(a, lib != NULL, "Could not load native library %s", dlerror());
+  
+  int* abi = dlsym(lib, "lnative_abi");
+  lval* (*load)(lenv*) = (lval* (*)(lenv*)) dlsym(lib, "lnative_load");
+  if (abi == NULL || *abi != LNATIVE_ABI || load == NULL) {
+    dlclose(lib);
+    LASSERT(a, 0, "Could not load native library %s: "
+      "not compiled by this version of lisp.", name);
   }
+  lval_del(a);
+  return load(e);
+#endif
 }
 
 /* Add builtin functions to environment */
 void lenv_add_builtins(lenv* e) {
   /* String Functions */
   lenv_add_builtin(e, "load", builtin_load);
+  lenv_add_builtin(e, "load-native", builtin_load_native);
   lenv_add_builtin(e, "error", builtin_error);
   lenv_add_builtin(e, "print", builtin_print);
   
@@ -1147,6 +5086,30 @@ void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, ">=", builtin_ge);
   lenv_add_builtin(e, "<=", builtin_le);
   
+  /* Loop Functions */
+  lenv_add_builtin(e, "while", builtin_while);
+  lenv_add_builtin(e, "loop", builtin_loop);
+  lenv_add_builtin(e, "dotimes", builtin_dotimes);
+  lenv_add_builtin(e, "for-each", builtin_for_each);
+
+  /* Parallel Functions */
+  lenv_add_builtin(e, "pmap", builtin_pmap);
+  lenv_add_builtin(e, "pfilter", builtin_pfilter);
+  lenv_add_builtin(e, "preduce", builtin_preduce);
+  lenv_add_builtin(e, "spawn", builtin_spawn);
+  lenv_add_builtin(e, "await", builtin_await);
+  lenv_add_builtin(e, "await-all", builtin_await_all);
+  lenv_add_builtin(e, "coroutine", builtin_coroutine);
+  lenv_add_builtin(e, "resume", builtin_resume);
+  lenv_add_builtin(e, "yield", builtin_yield);
+  lenv_add_builtin(e, "co-status", builtin_co_status);
+  lenv_add_builtin(e, "go", builtin_go);
+  lenv_add_builtin(e, "run", builtin_run);
+  lenv_add_builtin(e, "chan", builtin_chan);
+  lenv_add_builtin(e, "send", builtin_send);
+  lenv_add_builtin(e, "recv", builtin_recv);
+  lenv_add_builtin(e, "select-chan", builtin_select_chan);
+  
   /* Logical Operator Functions */
   lenv_add_builtin(e, "&&", builtin_and);
   lenv_add_builtin(e, "||", builtin_or);
@@ -1156,6 +5119,12 @@ void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, "def", builtin_def);
   lenv_add_builtin(e, "=", builtin_put);
   lenv_add_builtin(e, "\\", builtin_lambda);
+  lenv_add_builtin(e, "defmacro", builtin_defmacro);
+  
+  /* Memoisation Functions */
+  lenv_add_builtin(e, "memo", builtin_memo);
+  lenv_add_builtin(e, "memo-stats", builtin_memo_stats);
+  lenv_add_builtin(e, "memo-clear", builtin_memo_clear);
   
   /* List Functions */
   lenv_add_builtin(e, "list", builtin_list);
@@ -1163,6 +5132,8 @@ void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, "tail", builtin_tail);
   lenv_add_builtin(e, "eval", builtin_eval);
   lenv_add_builtin(e, "join", builtin_join);
+  lenv_add_builtin(e, "len", builtin_len);
+  lenv_add_builtin(e, "foldl", builtin_foldl);
   
   /* Mathematical Functions */
   lenv_add_builtin(e, "+", builtin_add);
@@ -1170,81 +5141,843 @@ void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, "*", builtin_mul);
   lenv_add_builtin(e, "/", builtin_div);
   lenv_add_builtin(e, "%", builtin_mod);
+  lenv_add_builtin(e, "max", builtin_max);
+  lenv_add_builtin(e, "min", builtin_min);
 }
 
-int main(int argc, char** argv) {
+/* The grammar of the language. Its parsers are built directly, the same way 
+     mpca_lang and mpc_re would build them from the rules given above each, 
+     saving the work of parsing the grammar and its regular expressions on 
+     every start. The rules are only written out here, so there is no second 
+     copy of the grammar to keep in step */
+
+/* Parts of a regular expression in sequence, folded as mpc_re does */
+mpc_parser_t* lgrammar_re_seq(int n, ...) {
+  va_list va;
+  va_start(va, n);
+  mpc_parser_t* p = mpc_lift(mpcf_ctor_str);
+  for (int i = 0; i < n; i++) {
+    p = mpc_and(2, mpcf_strfold, p, va_arg(va, mpc_parser_t*), free);
+  }
+  va_end(va);
+  return p;
+}
+
+/* Regular expression ^ */
+mpc_parser_t* lgrammar_re_start(void) {
+  return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
+}
+
+/* Regular expression $ */
+mpc_parser_t* lgrammar_re_end(void) {
+  return mpc_or(2,
+    mpc_and(2, mpcf_fst, mpc_newline(), mpc_eoi(), free),
+    mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free));
+}
+
+/* A /regex/ term in a rule */
+mpc_parser_t* lgrammar_regex(mpc_parser_t* re) {
+  mpc_optimise(re);
+  return mpca_state(mpca_tag(mpc_apply(mpc_tok(re), mpcf_str_ast), "regex"));
+}
+
+/* A 'c' term in a rule */
+mpc_parser_t* lgrammar_char(char c) {
+  return mpca_state(mpca_tag(mpc_apply(mpc_tok(mpc_char(c)), mpcf_str_ast), "char"));
+}
+
+/* A <name> term in a rule */
+mpc_parser_t* lgrammar_ref(mpc_parser_t* p, char* name) {
+  return mpca_state(mpca_root(mpca_add_tag(p, name)));
+}
+
+/* Terms of a rule in sequence, folded as mpca_lang does */
+mpc_parser_t* lgrammar_seq_va(int n, va_list va) {
+  mpc_parser_t* p = mpc_pass();
+  for (int i = 0; i < n; i++) { p = mpca_and(2, p, va_arg(va, mpc_parser_t*)); }
+  return p;
+}
+
+mpc_parser_t* lgrammar_seq(int n, ...) {
+  va_list va;
+  va_start(va, n);
+  mpc_parser_t* p = lgrammar_seq_va(n, va);
+  va_end(va);
+  return p;
+}
+
+/* Alternatives of a rule, each a sequence of one term */
+mpc_parser_t* lgrammar_alt(int n, ...) {
+  va_list va;
+  va_start(va, n);
+  mpc_parser_t** xs = malloc(sizeof(mpc_parser_t*) * n);
+  for (int i = 0; i < n; i++) { xs[i] = lgrammar_seq(1, va_arg(va, mpc_parser_t*)); }
+  va_end(va);
+  
+  mpc_parser_t* p = xs[n-1];
+  for (int i = n - 2; i >= 0; i--) { p = mpca_or(2, xs[i], p); }
+  free(xs);
+  return p;
+}
+
+void lgrammar_define(mpc_parser_t* p, mpc_parser_t* rule) {
+  mpc_optimise(rule);
+  mpc_define(p, rule);
+}
+
+/* Build the parsers, as mpca_lang would with the flags in lang. Of those, only 
+     MPCA_LANG_PACKRAT makes a difference to this grammar */
+void lgrammar_build(linterp* lisp, int lang) {
+  char* digits = "0123456789";
+  
+  // number : /-?[0-9]+(\.[0-9]*)?/
+  lgrammar_define(lisp->Number, lgrammar_seq(1, lgrammar_regex(lgrammar_re_seq(3,
+    mpc_maybe_lift(mpc_char('-'), mpcf_ctor_str),
+    mpc_many1(mpcf_strfold, mpc_oneof(digits)),
+    mpc_maybe_lift(lgrammar_re_seq(2,
+      mpc_char('.'),
+      mpc_many(mpcf_strfold, mpc_oneof(digits))), mpcf_ctor_str)))));
+  
+  // symbol : /[a-zA-Z0-9_+\-%*\/\\=<>!&|]+/
+  lgrammar_define(lisp->Symbol, lgrammar_seq(1, lgrammar_regex(lgrammar_re_seq(1,
+    mpc_many1(mpcf_strfold, mpc_oneof(
+      "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_+-%*/\\=<>!&|"))))));
+  
+  // string : /"(\\.|[^"])*"/
+  lgrammar_define(lisp->String, lgrammar_seq(1, lgrammar_regex(lgrammar_re_seq(3,
+    mpc_char('"'),
+    mpc_many(mpcf_strfold, mpc_or(2,
+      lgrammar_re_seq(2,
+        mpc_char('\\'),
+        mpc_expect(mpc_noneof("\n"), "any character except a newline")),
+      lgrammar_re_seq(1, mpc_noneof("\"")))),
+    mpc_char('"')))));
+  
+  // comment : /;[^\r\n]*/
+  lgrammar_define(lisp->Comment, lgrammar_seq(1, lgrammar_regex(lgrammar_re_seq(2,
+    mpc_char(';'),
+    mpc_many(mpcf_strfold, mpc_noneof("\r\n"))))));
+  
+  // sexpr : '(' <expr>* ')'
+  lgrammar_define(lisp->Sexpr, lgrammar_seq(3,
+    lgrammar_char('('), mpca_many(lgrammar_ref(lisp->Expr, "expr")), lgrammar_char(')')));
+  
+  // qexpr : '{' <expr>* '}'
+  lgrammar_define(lisp->Qexpr, lgrammar_seq(3,
+    lgrammar_char('{'), mpca_many(lgrammar_ref(lisp->Expr, "expr")), lgrammar_char('}')));
+  
+  // expr : <number> | <symbol> | <string> | <comment> | <sexpr> | <qexpr>
+  lgrammar_define(lisp->Expr, lgrammar_alt(6,
+    lgrammar_ref(lisp->Number, "number"), lgrammar_ref(lisp->Symbol, "symbol"),
+    lgrammar_ref(lisp->String, "string"), lgrammar_ref(lisp->Comment, "comment"),
+    lgrammar_ref(lisp->Sexpr, "sexpr"), lgrammar_ref(lisp->Qexpr, "qexpr")));
+  
+  // lispy : /^/ <expr>* /$/
+  lgrammar_define(lisp->Lispy, lgrammar_seq(3,
+    lgrammar_regex(lgrammar_re_seq(1, lgrammar_re_start())),
+    mpca_many(lgrammar_ref(lisp->Expr, "expr")),
+    lgrammar_regex(lgrammar_re_seq(1, lgrammar_re_end()))));
+  
+  // form : /\s*/ (<expr> | /$/)
+  lgrammar_define(lisp->Form, lgrammar_seq(2,
+    lgrammar_regex(lgrammar_re_seq(1, mpc_many(mpcf_strfold, mpc_whitespace()))),
+    lgrammar_alt(2,
+      lgrammar_ref(lisp->Expr, "expr"),
+      lgrammar_regex(lgrammar_re_seq(1, lgrammar_re_end())))));
+  
+  if (lang & MPCA_LANG_PACKRAT) {
+    mpc_parser_t* rules[] = { lisp->Number, lisp->Symbol, lisp->String,
+      lisp->Comment, lisp->Sexpr, lisp->Qexpr, lisp->Expr, lisp->Lispy, lisp->Form };
+    for (int i = 0; i < 9; i++) { mpca_packrat(rules[i]); }
+  }
+}
+
+/* Interpreters */
+pthread_once_t linit_once = PTHREAD_ONCE_INIT;
+
+/* Set up what every interpreter shares, once */
+void linit(void) {
+  ltag_init();
+  lpure_init();
+  lprog_init();
+  lcoro_init();
+}
+
+/* Make e the global environment of an interpreter, deleting the one before */
+void linterp_set_env(linterp* lisp, lenv* e) {
+  if (lisp->snapshot) { lenv_release(lisp->snapshot); }
+  lisp->snapshot = NULL;
+  if (lisp->env) { lenv_del(lisp->env); }
+  lisp->env = e;
+  e->interp = lisp;
+}
+
+/* A new interpreter with the builtins in its global environment, parsing as 
+     mpca_lang would with the flags in lang (MPCA_LANG_DEFAULT for none). One 
+     interpreter is only to be used by one thread at a time, but several may 
+     be used at once */
+linterp* linterp_new(int lang) {
+  pthread_once(&linit_once, linit);
+  linterp* lisp = malloc(sizeof(linterp));
+  
   /* Create some parsers */
-  Number = mpc_new("number");
-  Symbol = mpc_new("symbol");
-  Sexpr = mpc_new("sexpr");
-  Qexpr = mpc_new("qexpr");
-  Expr = mpc_new("expr");
-  Lispy = mpc_new("lispy");
-  String = mpc_new("string");
-  Comment = mpc_new("comment");
+  lisp->Number = mpc_new("number");
+  lisp->Symbol = mpc_new("symbol");
+  lisp->Sexpr = mpc_new("sexpr");
+  lisp->Qexpr = mpc_new("qexpr");
+  lisp->Expr = mpc_new("expr");
+  lisp->Lispy = mpc_new("lispy");
+  lisp->String = mpc_new("string");
+  lisp->Comment = mpc_new("comment");
+  lisp->Form = mpc_new("form");
   
   /* Define with following Language */
-  mpca_lang(MPCA_LANG_DEFAULT,
-    "							\
-      number	: /-?[0-9]+(\\.[0-9]*)?/ ;		\
-      symbol	: /[a-zA-Z0-9_+\\-%*\\/\\\\=<>!&|]+/ ;	\
-      string	: /\"(\\\\.|[^\"])*\"/ ;		\
-      comment	: /;[^\\r\\n]*/ ;			\
-      sexpr	: '(' <expr>* ')' ;			\
-      qexpr	: '{' <expr>* '}' ;			\
-      expr  	: <number> | <symbol> | <string> 	\
-      		| <comment> | <sexpr> | <qexpr> ;	\
-      lispy	: /^/ <expr>* /$/ ;			\
-    ",
-    Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
-  
-  /* Create new environment and add builtin functions */
-  lenv* e = lenv_new();
-  lenv_add_builtins(e);
+  lgrammar_build(lisp, lang);
+  
+  lisp->env = NULL;
+  lisp->snapshot = NULL;
+  linterp_set_env(lisp, lenv_new());
+  lenv_add_builtins(lisp->env);
+  lisp->load_streaming = 0;
+  lisp->load_caching = 1;
+  lisp->macro_names = 0;
+  lisp->native_count = 0;
+  lisp->natives = NULL;
+  return lisp;
+}
+
+void linterp_del(linterp* lisp) {
+  if (lisp->snapshot) { lenv_release(lisp->snapshot); }
+  lenv_del(lisp->env);
+  for (int i = 0; i < lisp->native_count; i++) {
+    lnative* n = &lisp->natives[i];
+    for (int j = 0; j < n->count; j++) { if (n->consts[j]) { lval_del(n->consts[j]); } }
+    free(n->consts);
+  }
+  free(lisp->natives);
+  /* Undefine and Delete the Parser */
+  mpc_cleanup(9, lisp->Number, lisp->Symbol, lisp->String, lisp->Comment,
+    lisp->Sexpr, lisp->Qexpr, lisp->Expr, lisp->Lispy, lisp->Form);
+  free(lisp);
+}
+
+/* The interpreter an environment belongs to, that of the global environment at
+     the end of its chain */
+linterp* lenv_interp(lenv* e) {
+  while (e->par) { e = e->par; }
+  return e->interp;
+}
+
+/* Heap images. Once the standard library (or any other files) have been 
+     loaded the global environment can be written to a file, and read straight 
+     back in on the next start in place of adding the builtins and loading */
+#define LIMAGE_MAGIC 0x4C535949 // "LSYI"
+#define LIMAGE_VERSION 1
+
+/* Global environment encoded in a whole buffer; NULL if it is not an image */
+lenv* limage_decode(lbuf* b) {
+  lenv* e = NULL;
+  uint32_t head[2];
+  if (lbuf_get(b, head, sizeof(head)) 
+  && head[0] == LIMAGE_MAGIC && head[1] == LIMAGE_VERSION) {
+    lenv* builtins = lenv_new();
+    lenv_add_builtins(builtins);
+    e = lbuf_get_env(b, builtins);
+    lenv_del(builtins);
+    if (e && b->pos != b->len) { lenv_del(e); e = NULL; }
+  }
+  return e;
+}
+
+/* Returns 0 if the image could not be written, or would not read back */
+int limage_save(char* filename, lenv* e) {
+  lenv* builtins = lenv_new();
+  lenv_add_builtins(builtins);
   
-  if (argc == 1) {
+  lbuf b = { NULL, 0, 0, 0 };
+  uint32_t head[2] = { LIMAGE_MAGIC, LIMAGE_VERSION };
+  lbuf_put(&b, head, sizeof(head));
+  lbuf_put_env(&b, e, builtins);
+  lenv_del(builtins);
+  
+  /* Read it back first, rather than leave an image that --image rejects */
+  lbuf r = b;
+  lenv* back = limage_decode(&r);
+  if (back == NULL) {
+    free(b.data);
+    return 0;
+  }
+  lenv_del(back);
+  
+  FILE* f = fopen(filename, "wb");
+  int ok = f && fwrite(b.data, 1, b.len, f) == b.len;
+  if (f) { ok = fclose(f) == 0 && ok; }
+  free(b.data);
+  return ok;
+}
+
+/* Returns NULL if the file is missing or not an image */
+lenv* limage_load(char* filename) {
+  FILE* f = fopen(filename, "rb");
+  if (f == NULL) { return NULL; }
+  
+  lbuf b = { NULL, 0, 0, 0 };
+  char chunk[4096];
+  size_t got;
+  while ((got = fread(chunk, 1, sizeof(chunk), f)) > 0) { lbuf_put(&b, chunk, got); }
+  fclose(f);
+  
+  lenv* e = limage_decode(&b);
+  free(b.data);
+  return e;
+}
+
+/* Ahead-of-time compilation. A file is read and expanded as load would do, and 
+     each top-level expression is written out as C doing what evaluating it 
+     does, through the same runtime: an Sexpr becomes its children, worked out 
+     in order, then called as lval_eval_sexpr would, and a symbol a lookup 
+     through a cache shared by every use of its name. That alone saves walking 
+     the expressions. Two builtins get more. An 'if' with literal branches runs 
+     only the branch taken, itself compiled, and a '\' with a literal body has 
+     the body compiled into a C function of its own which the new function runs 
+     when called. So code written with fun, select and case does not go through 
+     the evaluator at all. Either checks when run that its name still means the 
+     builtin, and makes the ordinary call if not */
+
+/* Formatted text onto the end of a buffer */
+void lbuf_vprintf(lbuf* b, char* fmt, va_list va) {
+  va_list vc;
+  va_copy(vc, va);
+  int n = vsnprintf(NULL, 0, fmt, vc);
+  va_end(vc);
+  char* s = malloc(n + 1);
+  vsnprintf(s, n + 1, fmt, va);
+  lbuf_put(b, s, n);
+  free(s);
+}
+
+void lbuf_printf(lbuf* b, char* fmt, ...) {
+  va_list va;
+  va_start(va, fmt);
+  lbuf_vprintf(b, fmt, va);
+  va_end(va);
+}
+
+/* A string as a C string literal */
+void lbuf_put_cstr(lbuf* b, char* s) {
+  lbuf_put(b, "\"", 1);
+  for (; *s; s++) {
+    unsigned char ch = *s;
+    /* Octal for the rest, and for '?' so nothing reads as a trigraph */
+    if (ch >= ' ' && ch <= '~' && ch != '"' && ch != '\\' && ch != '?') {
+      lbuf_put(b, s, 1);
+    } else {
+      lbuf_printf(b, "\\%03o", ch);
+    }
+  }
+  lbuf_put(b, "\"", 1);
+}
+
+typedef struct {
+  lbuf init;      /* statements making the constants K[] */
+  lbuf funcs;     /* compiled function bodies, each ahead of any use */
+  int consts;
+  int funcs_made;
+  int temps;
+  int depth;      /* nesting of the statement being written */
+  /* Constants holding symbols to look up, by name */
+  int syms;
+  char** sym_names;
+  int* sym_consts;
+} lcomp;
+
+/* Write a statement at the current nesting */
+void lcomp_line(lcomp* c, lbuf* b, char* fmt, ...) {
+  for (int i = 0; i < c->depth; i++) { lbuf_put(b, "  ", 2); }
+  va_list va;
+  va_start(va, fmt);
+  lbuf_vprintf(b, fmt, va);
+  va_end(va);
+  lbuf_put(b, "\n", 1);
+}
+
+/* C expression making a value other than a list */
+void lcomp_atom(lbuf* b, lval* v) {
+  switch (v->type) {
+    case LVAL_NUM: lbuf_printf(b, "lval_num(%ld)", (long) v->num); break;
+    /* In hexadecimal, which is exact */
+    case LVAL_DOUBLE: lbuf_printf(b, "lval_double(%a)", v->num); break;
+    case LVAL_SYM: lbuf_printf(b, "lval_sym("); lbuf_put_cstr(b, v->sym); break;
+    case LVAL_STR: lbuf_printf(b, "lval_str("); lbuf_put_cstr(b, v->str); break;
+    case LVAL_ERR: lbuf_printf(b, "lval_err(\"%%s\", "); lbuf_put_cstr(b, v->err); break;
+    /* Not found in anything read or expanded */
+    default: lbuf_printf(b, "lval_err(\"Function value in compiled code\""); break;
+  }
+  if (v->type != LVAL_NUM && v->type != LVAL_DOUBLE) { lbuf_put(b, ")", 1); }
+}
+
+/* Write the making of a constant, returning the temporary holding it */
+int lcomp_build(lcomp* c, lval* v) {
+  int t = c->temps++;
+  if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) {
+    lbuf_printf(&c->init, "  lval* t%d = ", t);
+    lcomp_atom(&c->init, v);
+    lbuf_printf(&c->init, ";\n");
+    return t;
+  }
+  
+  lbuf_printf(&c->init, "  lval* t%d = %s;\n", t,
+    v->type == LVAL_SEXPR ? "lval_sexpr()" : "lval_qexpr()");
+  for (int i = 0; i < v->count; i++) {
+    lval* x = v->cell[i];
+    if (x->type == LVAL_SEXPR || x->type == LVAL_QEXPR) {
+      lbuf_printf(&c->init, "  lval_add(t%d, t%d);\n", t, lcomp_build(c, x));
+    } else {
+      lbuf_printf(&c->init, "  lval_add(t%d, ", t);
+      lcomp_atom(&c->init, x);
+      lbuf_printf(&c->init, ");\n");
+    }
+  }
+  return t;
+}
+
+/* Index in K[] of a new constant holding v */
+int lcomp_const(lcomp* c, lval* v) {
+  int t = lcomp_build(c, v);
+  lbuf_printf(&c->init, "  K[%d] = t%d;\n", c->consts, t);
+  return c->consts++;
+}
+
+/* Index in K[] of the symbol to look a name up by */
+int lcomp_sym(lcomp* c, char* name) {
+  for (int i = 0; i < c->syms; i++) {
+    if (strcmp(c->sym_names[i], name) == 0) { return c->sym_consts[i]; }
+  }
+  c->syms++;
+  c->sym_names = realloc(c->sym_names, sizeof(char*) * c->syms);
+  c->sym_consts = realloc(c->sym_consts, sizeof(int) * c->syms);
+  c->sym_names[c->syms-1] = malloc(strlen(name) + 1);
+  strcpy(c->sym_names[c->syms-1], name);
+  c->sym_consts[c->syms-1] = c->consts;
+  
+  lbuf_printf(&c->init, "  K[%d] = lnative_sym(e, ", c->consts);
+  lbuf_put_cstr(&c->init, name);
+  lbuf_printf(&c->init, ");\n");
+  return c->consts++;
+}
+
+int lcomp_sexpr(lcomp* c, lbuf* b, lval** cells, int count);
+
+/* Write the evaluation of x, returning the temporary holding its value */
+int lcomp_expr(lcomp* c, lbuf* b, lval* x) {
+  if (x->type == LVAL_SEXPR) { return lcomp_sexpr(c, b, x->cell, x->count); }
+  
+  int t = c->temps++;
+  if (x->type == LVAL_SYM) {
+    lcomp_line(c, b, "lval* t%d = lenv_get(e, K[%d]);", t, lcomp_sym(c, x->sym));
+  } else if (x->type == LVAL_NUM) {
+    lcomp_line(c, b, "lval* t%d = lval_num(%ld);", t, (long) x->num);
+  } else {
+    /* Everything else evaluates to itself */
+    lcomp_line(c, b, "lval* t%d = lval_copy(K[%d]);", t, lcomp_const(c, x));
+  }
+  return t;
+}
+
+/* Write the call of the values in temporaries ts (or, past given of them, 
+     literals that evaluate to themselves) into r */
+void lcomp_call(lcomp* c, lbuf* b, int r, int* ts, int given, lval** cells, int count) {
+  lbuf args = { NULL, 0, 0, 0 };
+  for (int i = 0; i < count; i++) {
+    if (i < given) {
+      lbuf_printf(&args, ", t%d", ts[i]);
+    } else {
+      lbuf_printf(&args, ", lval_copy(K[%d])", lcomp_const(c, cells[i]));
+    }
+  }
+  lcomp_line(c, b, "t%d = lnative_call(e, %d%.*s);", r, count, (int) args.len, args.data);
+  free(args.data);
+}
+
+/* Compile a function body into lc_fn<n>, returning n */
+int lcomp_function(lcomp* c, lval* body) {
+  lbuf b = { NULL, 0, 0, 0 };
+  int depth = c->depth;
+  c->depth = 1;
+  int n = c->funcs_made++;
+  
+  lbuf_printf(&b, "static lval* lc_fn%d(lenv* e, lval** K) {\n", n);
+  int t = lcomp_sexpr(c, &b, body->cell, body->count);
+  lbuf_printf(&b, "  return t%d;\n}\n\n", t);
+  
+  lbuf_put(&c->funcs, b.data, b.len);
+  free(b.data);
+  c->depth = depth;
+  return n;
+}
+
+/* True if v is the symbol s */
+int lcomp_is_sym(lval* v, char* s) {
+  return v->type == LVAL_SYM && strcmp(v->sym, s) == 0;
+}
+
+/* Write the evaluation of an Sexpr of the given cells */
+int lcomp_sexpr(lcomp* c, lbuf* b, lval** cells, int count) {
+  /* Empty and single expressions as lval_eval_sexpr treats them */
+  if (count == 0) {
+    int t = c->temps++;
+    lcomp_line(c, b, "lval* t%d = lval_sexpr();", t);
+    return t;
+  }
+  if (count == 1) { return lcomp_expr(c, b, cells[0]); }
+  
+  int is_if = lcomp_is_sym(cells[0], "if") && count == 4
+    && cells[2]->type == LVAL_QEXPR && cells[3]->type == LVAL_QEXPR;
+  int is_lambda = lcomp_is_sym(cells[0], "\\") && count == 3
+    && cells[1]->type == LVAL_QEXPR && cells[2]->type == LVAL_QEXPR;
+  
+  /* Literal Q-Expressions need no temporaries; the call copies them in */
+  int* ts = malloc(sizeof(int) * count);
+  int given = 0;
+  for (; given < count; given++) {
+    if (cells[given]->type == LVAL_QEXPR) {
+      int rest = given;
+      while (rest < count && cells[rest]->type == LVAL_QEXPR) { rest++; }
+      if (rest == count) { break; }
+    }
+    ts[given] = lcomp_expr(c, b, cells[given]);
+  }
+  
+  int r = c->temps++;
+  lcomp_line(c, b, "lval* t%d;", r);
+  
+  if (is_if && given == 2) {
+    int truth = c->temps++;
+    lcomp_line(c, b, "int t%d = lnative_is(t%d, builtin_if) ? lnative_truth(t%d) : -1;",
+      truth, ts[0], ts[1]);
+    for (int branch = 2; branch <= 3; branch++) {
+      lcomp_line(c, b, branch == 2 ? "if (t%d == 1) {" : "} else if (t%d == 0) {", truth);
+      c->depth++;
+      lcomp_line(c, b, "lval_del(t%d);", ts[0]);
+      lcomp_line(c, b, "lval_del(t%d);", ts[1]);
+      int x = lcomp_sexpr(c, b, cells[branch]->cell, cells[branch]->count);
+      lcomp_line(c, b, "t%d = t%d;", r, x);
+      c->depth--;
+    }
+    lcomp_line(c, b, "} else {");
+    c->depth++;
+    lcomp_call(c, b, r, ts, given, cells, count);
+    c->depth--;
+    lcomp_line(c, b, "}");
+  } else if (is_lambda && given == 1) {
+    int fn = lcomp_function(c, cells[2]);
+    int made = c->temps++;
+    lcomp_line(c, b, "int t%d = lnative_is(t%d, builtin_lambda);", made, ts[0]);
+    lcomp_call(c, b, r, ts, given, cells, count);
+    /* The body is the last constant the call made */
+    lcomp_line(c, b, "if (t%d) { lnative_lambda(t%d, lc_fn%d, K[%d], K); }",
+      made, r, fn, c->consts - 1);
+  } else {
+    lcomp_call(c, b, r, ts, given, cells, count);
+  }
+  
+  free(ts);
+  return r;
+}
+
+#define LCOMP_PRELUDE "\
+typedef struct lval lval;\n\
+typedef struct lenv lenv;\n\
+typedef lval*(*lbuiltin)(lenv*, lval*);\n\
+typedef lval*(*lcode)(lenv*, lval**);\n\
+\n\
+lval* lval_num(long x);\n\
+lval* lval_double(double x);\n\
+lval* lval_err(char* m, ...);\n\
+lval* lval_sym(char* s);\n\
+lval* lval_str(char* s);\n\
+lval* lval_sexpr(void);\n\
+lval* lval_qexpr(void);\n\
+lval* lval_add(lval* v, lval* x);\n\
+lval* lval_copy(lval* v);\n\
+void lval_del(lval* v);\n\
+lval* lenv_get(lenv* e, lval* k);\n\
+lval* lnative_call(lenv* e, int count, ...);\n\
+lval* lnative_sym(lenv* e, char* s);\n\
+int lnative_is(lval* f, lbuiltin b);\n\
+int lnative_truth(lval* x);\n\
+lval* lnative_lambda(lval* f, lcode code, lval* body, lval** consts);\n\
+lval** lnative_consts(lenv* e, int* lib, int count, void (*init)(lenv*, lval**));\n\
+void lnative_result(lval* x);\n\
+lval* builtin_if(lenv* e, lval* a);\n\
+lval* builtin_lambda(lenv* e, lval* a);\n\
+\n"
+
+/* Compile a file to C, for load-native once built into a shared object. 
+     Definitions of macros, and loads of the files that might hold them, are 
+     also evaluated in e along the way so later expressions expand as they will 
+     when loaded. Returns 0 and prints why on failure */
+int lcomp_file(lenv* e, char* in, char* out) {
+  lval* expr = lval_read_file(lenv_interp(e), in);
+  if (expr->type == LVAL_ERR) {
+    lval_println(expr);
+    lval_del(expr);
+    return 0;
+  }
+  
+  lcomp c = { { NULL, 0, 0, 0 }, { NULL, 0, 0, 0 }, 0, 0, 0, 1, 0, NULL, NULL };
+  lbuf top = { NULL, 0, 0, 0 };
+  for (int i = 0; i < expr->count; i++) {
+    lval* x = lval_expand(e, expr->cell[i]);
+    lcomp_line(&c, &top, "lnative_result(t%d);", lcomp_expr(&c, &top, x));
+    
+    if (x->type == LVAL_SEXPR && x->count > 0
+      && (lcomp_is_sym(x->cell[0], "defmacro") || lcomp_is_sym(x->cell[0], "load"))) {
+      lnative_result(lval_eval(e, x));
+    } else {
+      lval_del(x);
+    }
+  }
+  expr->count = 0;
+  lval_del(expr);
+  
+  /* Name of the shared object to suggest, out with .c replaced by .so */
+  size_t stem = strlen(out);
+  if (stem > 2 && strcmp(out + stem - 2, ".c") == 0) { stem -= 2; }
+  
+  lbuf b = { NULL, 0, 0, 0 };
+  lbuf_printf(&b, "/* Compiled from %s by lisp --compile. Build with\n"
+    "     cc -shared -fPIC -o %.*s.so %s\n"
+    "   and load with (load-native \"%.*s.so\") */\n\n",
+    in, (int) stem, out, out, (int) stem, out);
+  lbuf_printf(&b, "%s", LCOMP_PRELUDE);
+  lbuf_printf(&b, "int lnative_abi = %d;\n\n", LNATIVE_ABI);
+  lbuf_printf(&b, "static void lc_init(lenv* e, lval** K) {\n");
+  lbuf_put(&b, c.init.data, c.init.len);
+  lbuf_printf(&b, "}\n\n");
+  lbuf_put(&b, c.funcs.data, c.funcs.len);
+  lbuf_printf(&b, "lval* lnative_load(lenv* e) {\n"
+    "  lval** K = lnative_consts(e, &lnative_abi, %d, lc_init);\n", c.consts + 1);
+  lbuf_put(&b, top.data, top.len);
+  lbuf_printf(&b, "  return lval_sexpr();\n}\n");
+  
+  FILE* f = fopen(out, "wb");
+  int ok = f && fwrite(b.data, 1, b.len, f) == b.len;
+  if (f) { ok = fclose(f) == 0 && ok; }
+  if (!ok) {
+    lval* err = lval_err("Could not write %s", out);
+    lval_println(err);
+    lval_del(err);
+  }
+  
+  free(b.data);
+  free(top.data);
+  free(c.init.data);
+  free(c.funcs.data);
+  for (int i = 0; i < c.syms; i++) { free(c.sym_names[i]); }
+  free(c.sym_names);
+  free(c.sym_consts);
+  return ok;
+}
+
+/* Incremental reader. Input arrives in chunks, a line from readline or a piece
+     of a larger form from a pipe, and each byte is scanned only once: the
+     reader remembers how deep in brackets it is and whether it is inside a
+     string or comment. An entry is complete at the first newline outside any
+     open form, so a single line reads exactly as before and a form left open
+     simply carries on into the following lines */
+typedef struct {
+  char* buf;
+  size_t start;   /* start of the pending entry */
+  size_t scanned; /* end of the bytes already scanned */
+  size_t len;
+  size_t cap;
+  int depth;
+  int in_str;
+  int escape;
+  int in_comment;
+} lreader;
+
+lreader* lreader_new(void) {
+  return calloc(1, sizeof(lreader));
+}
+
+void lreader_del(lreader* rd) {
+  free(rd->buf);
+  free(rd);
+}
+
+void lreader_feed(lreader* rd, char* s, size_t n) {
+  /* Drop entries already handed out before growing */
+  if (rd->start) {
+    memmove(rd->buf, rd->buf + rd->start, rd->len - rd->start);
+    rd->len -= rd->start;
+    rd->scanned -= rd->start;
+    rd->start = 0;
+  }
+  if (rd->len + n + 1 > rd->cap) {
+    rd->cap = (rd->len + n + 1) * 2;
+    rd->buf = realloc(rd->buf, rd->cap);
+  }
+  memcpy(rd->buf + rd->len, s, n);
+  rd->len += n;
+}
+
+/* Returns the next complete entry (to be freed), or NULL if more input is needed */
+char* lreader_next(lreader* rd) {
+  while (rd->scanned < rd->len) {
+    char c = rd->buf[rd->scanned++];
+    if (rd->in_comment) {
+      if (c == '\n' || c == '\r') { rd->in_comment = 0; }
+      else { continue; }
+    }
+    if (rd->in_str) {
+      if (rd->escape) { rd->escape = 0; }
+      else if (c == '\\') { rd->escape = 1; }
+      else if (c == '"') { rd->in_str = 0; }
+      continue;
+    }
+    switch (c) {
+      case '"': rd->in_str = 1; break;
+      case ';': rd->in_comment = 1; break;
+      case '(': case '{': rd->depth++; break;
+      /* A stray close can't be fixed by more input; leave it to the parser */
+      case ')': case '}': if (rd->depth > 0) { rd->depth--; } break;
+      case '\n':
+        if (rd->depth == 0) {
+          size_t n = rd->scanned - rd->start;
+          char* entry = malloc(n + 1);
+          memcpy(entry, rd->buf + rd->start, n);
+          entry[n] = '\0';
+          rd->start = rd->scanned;
+          return entry;
+        }
+        break;
+    }
+  }
+  return NULL;
+}
+
+/* True while part of an entry has been read */
+int lreader_pending(lreader* rd) {
+  return rd->len > rd->start;
+}
+
+int main(int argc, char** argv) {
+  /* Strip interpreter options; the remaining arguments are files to load */
+  int lang = MPCA_LANG_DEFAULT;
+  int streaming = 0;
+  int caching = 1;
+  char* image_in = NULL;
+  char* image_out = NULL;
+  char* compile_in = NULL;
+  char* compile_out = NULL;
+  int n = 1;
+  for (int i = 1; i < argc; i++) {
+    /* Memoise grammar rules while parsing (packrat) */
+    if (strcmp(argv[i], "--packrat") == 0) { lang |= MPCA_LANG_PACKRAT; continue; }
+    /* Evaluate each top-level expression as it is read */
+    if (strcmp(argv[i], "--stream") == 0) { streaming = 1; continue; }
+    /* Always parse loaded files, neither using nor writing cached copies */
+    if (strcmp(argv[i], "--no-cache") == 0) { caching = 0; continue; }
+    /* Start from a saved heap image rather than the builtins and stdlib */
+    if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) { image_in = argv[++i]; continue; }
+    /* Save a heap image once loading is done, instead of starting the REPL */
+    if (strcmp(argv[i], "--save-image") == 0 && i + 1 < argc) { image_out = argv[++i]; continue; }
+    /* Compile a file to C (written to the -o file, else beside it) and exit */
+    if (strcmp(argv[i], "--compile") == 0 && i + 1 < argc) { compile_in = argv[++i]; continue; }
+    if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) { compile_out = argv[++i]; continue; }
+    /* Megabytes of stack each coroutine gets */
+    if (strcmp(argv[i], "--coro-stack") == 0 && i + 1 < argc) {
+      long mb = atol(argv[++i]);
+      if (mb > 0) { lcoro_stack_size = (size_t) mb << 20; }
+      continue;
+    }
+    argv[n++] = argv[i];
+  }
+  argc = n;
+  
+  linterp* lisp = linterp_new(lang);
+  lisp->load_streaming = streaming;
+  lisp->load_caching = caching;
+  
+  /* Restore the environment from an image if given */
+  lenv* img = image_in ? limage_load(image_in) : NULL;
+  if (image_in && img == NULL) {
+    lval* err = lval_err("Could not load image %s", image_in);
+    lval_println(err);
+    lval_del(err);
+  }
+  int from_image = img != NULL;
+  if (img) { linterp_set_env(lisp, img); }
+  lenv* e = lisp->env;
+  
+  int status = 0;
+  if (compile_in) {
+    /* Next to the file by default, as foo.c for foo.lspy */
+    char* out = compile_out;
+    if (out == NULL) {
+      size_t stem = strlen(compile_in);
+      if (stem > 5 && strcmp(compile_in + stem - 5, ".lspy") == 0) { stem -= 5; }
+      out = malloc(stem + 3);
+      sprintf(out, "%.*s.c", (int) stem, compile_in);
+    }
+    status = lcomp_file(e, compile_in, out) ? 0 : 1;
+    if (out != compile_out) { free(out); }
+  
+  } else if (argc == 1) {
   
     /* Print Version and Exit Information */
     puts("Lispy Version 0.0.0.0.5");
     puts("Press Ctrl+c to Exit\n");
       
-    /* Load stdlib file */
-    puts("Loading in stdlib...");
-    lval* stdlib = lval_add(lval_sexpr(), lval_str("stdlib.lspy"));
-    lval* s = builtin_load(e, stdlib);
-    if (s->type == LVAL_ERR) { lval_println(s); }
-    lval_del(s);
-    puts("stdlib loaded in\n");
-  
-    /* In a never ending loop */
-    while (1) {
-      /* Output prompt and get input */
-      char* input = readline("lispy> ");
+    /* Load stdlib file, unless already in the image */
+    if (!from_image) {
+      puts("Loading in stdlib...");
+      lval* stdlib = lval_add(lval_sexpr(), lval_str("stdlib.lspy"));
+      lval* s = builtin_load(e, stdlib);
+      if (s->type == LVAL_ERR) { lval_println(s); }
+      lval_del(s);
+      puts("stdlib loaded in\n");
+    }
+  
+    /* In a never ending loop, unless only saving an image */
+    lreader* rd = lreader_new();
+    while (!image_out) {
+      /* Output prompt and get input, prompting differently inside an open form */
+      char* input = readline(lreader_pending(rd) ? "  ...> " : "lispy> ");
+      if (input == NULL) { break; }
       /* Add input to history */
       add_history(input);
-      
-      /* Attempt to parse user input */
-      mpc_result_t r;
-      if (mpc_parse("<stdin>", input, Lispy, &r)) {
-        /* On success print the AST */
-        lval* x = lval_eval(e, lval_read(r.output));
-        lval_println(x);
-        lval_del(x);
-        
-        mpc_ast_delete(r.output);
-      } else {
-        /* Otherwise print error */
-        mpc_err_print(r.error);
-        mpc_err_delete(r.error);
-      }
-    
+      lreader_feed(rd, input, strlen(input));
+      lreader_feed(rd, "\n", 1);
       /* Free retrieved input */
       free(input);
+      
+      /* Attempt to parse each complete entry */
+      char* entry;
+      while ((entry = lreader_next(rd))) {
+        mpc_result_t r;
+        if (mpc_parse("<stdin>", entry, lisp->Lispy, &r)) {
+          /* On success print the AST */
+          lval* x = lval_eval(e, lval_expand(e, lval_read(r.output)));
+          lval_println(x);
+          lval_del(x);
+          
+          mpc_ast_delete(r.output);
+        } else {
+          /* Otherwise print error */
+          mpc_err_print(r.error);
+          mpc_err_delete(r.error);
+        }
+        free(entry);
+      }
     }
+    lreader_del(rd);
   }
   
   /* If supplied with list of files */
-  if (argc >= 2) {
+  if (argc >= 2 && !compile_in) {
     /* loop over each supplied filename */
     for (int i = 1; i < argc; i++) {
       /* Argument list with single argument (filename) */
@@ -1257,12 +5990,15 @@ int main(int argc, char** argv) {
       lval_del(x);
     }
   }
-    
-  /* Delete environment */
-  lenv_del(e);
   
-  /* Undefine and Delete the Parser */
-  mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+  if (image_out && !limage_save(image_out, e)) {
+    lval* err = lval_err("Could not save image %s", image_out);
+    lval_println(err);
+    lval_del(err);
+  }
+    
+  /* Delete environment and parsers */
+  linterp_del(lisp);
   
-  return 0;
+  return status;
 } 
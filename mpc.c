@@ -1,5 +1,19 @@
 #include "mpc.h"
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 /*
 ** State Type
 */
@@ -22,6 +36,213 @@ static mpc_state_t mpc_state_new(void) {
   return s;
 }
 
+/*
+** AST Tags
+**
+** Tags are interned. Every distinct tag string
+** is stored once, for the life of the program,
+** and nodes simply point at the shared copy. So
+** tags are never freed or written through and
+** two tags are equal exactly when the pointers
+** are. The table is shared between threads so
+** it is guarded by a lock; inputs keep a small
+** cache of tag joins in front of it.
+*/
+
+static char mpc_tag_empty[] = "";
+static char mpc_tag_root[] = ">";
+
+#ifdef _WIN32
+static SRWLOCK mpc_tags_lock = SRWLOCK_INIT;
+static void mpc_tags_acquire(void) { AcquireSRWLockExclusive(&mpc_tags_lock); }
+static void mpc_tags_release(void) { ReleaseSRWLockExclusive(&mpc_tags_lock); }
+#else
+static pthread_mutex_t mpc_tags_lock = PTHREAD_MUTEX_INITIALIZER;
+static void mpc_tags_acquire(void) { pthread_mutex_lock(&mpc_tags_lock); }
+static void mpc_tags_release(void) { pthread_mutex_unlock(&mpc_tags_lock); }
+#endif
+static char **mpc_tags = NULL;
+static size_t mpc_tags_slots = 0;
+static size_t mpc_tags_num = 0;
+
+static size_t mpc_tag_hash(const char *s) {
+  size_t h = 2166136261u;
+  while (*s) { h = (h ^ (unsigned char)*s++) * 16777619u; }
+  return h;
+}
+
+static void mpc_tags_grow(void) {
+  size_t j, h, slots = mpc_tags_slots ? mpc_tags_slots * 2 : 64;
+  char **tags = calloc(slots, sizeof(char*));
+  for (j = 0; j < mpc_tags_slots; j++) {
+    if (mpc_tags[j] == NULL) { continue; }
+    h = mpc_tag_hash(mpc_tags[j]) & (slots-1);
+    while (tags[h]) { h = (h+1) & (slots-1); }
+    tags[h] = mpc_tags[j];
+  }
+  free(mpc_tags);
+  mpc_tags = tags;
+  mpc_tags_slots = slots;
+}
+
+char *mpc_ast_intern(const char *tag) {
+
+  size_t h;
+  char *t;
+
+  if (tag[0] == '\0') { return mpc_tag_empty; }
+  if (strcmp(tag, ">") == 0) { return mpc_tag_root; }
+
+  mpc_tags_acquire();
+
+  if ((mpc_tags_num+1) * 2 > mpc_tags_slots) { mpc_tags_grow(); }
+
+  h = mpc_tag_hash(tag) & (mpc_tags_slots-1);
+  while (mpc_tags[h]) {
+    if (strcmp(mpc_tags[h], tag) == 0) {
+      t = mpc_tags[h];
+      mpc_tags_release();
+      return t;
+    }
+    h = (h+1) & (mpc_tags_slots-1);
+  }
+
+  t = malloc(strlen(tag) + 1);
+  strcpy(t, tag);
+  mpc_tags[h] = t;
+  mpc_tags_num++;
+
+  mpc_tags_release();
+  return t;
+}
+
+enum {
+  MPC_TAG_SET  = 0,
+  MPC_TAG_ADD  = 1,
+  MPC_TAG_ROOT = 2
+};
+
+/*
+** Builds the tag `mpc_ast_tag`, `mpc_ast_add_tag`
+** or `mpc_ast_add_root_tag` would give a node
+** tagged `y` when applied with `x`.
+*/
+
+static char *mpc_tag_join(int kind, const char *x, const char *y) {
+
+  char buf[256];
+  char *s;
+  char *t;
+  size_t xn, yn, n;
+
+  if (kind == MPC_TAG_SET) { return mpc_ast_intern(x); }
+
+  xn = strlen(x) - (kind == MPC_TAG_ROOT);
+  yn = strlen(y);
+
+  n = xn + (kind == MPC_TAG_ADD) + yn;
+  s = n < sizeof(buf) ? buf : malloc(n + 1);
+  memcpy(s, x, xn);
+  if (kind == MPC_TAG_ADD) { s[xn++] = '|'; }
+  memcpy(s + xn, y, yn + 1);
+
+  t = mpc_ast_intern(s);
+  if (s != buf) { free(s); }
+  return t;
+}
+
+/*
+** AST Arenas
+**
+** The nodes built during a single parse are
+** allocated from an arena: nodes in one list of
+** blocks and their contents and child arrays in
+** another. When the parse succeeds the arena is
+** handed to the root node and deleting the root
+** releases the whole tree at once. Deleting any
+** other arena node does nothing.
+*/
+
+enum {
+  MPC_AST_NODES_MIN = 64,
+  MPC_AST_NODES_MAX = 65536,
+  MPC_AST_BYTES_MIN = 1024,
+  MPC_AST_BYTES_MAX = 1048576
+};
+
+typedef struct mpc_ast_block_t {
+  struct mpc_ast_block_t *next;
+  size_t size;
+  size_t used;
+} mpc_ast_block_t;
+
+struct mpc_ast_arena_t {
+  mpc_ast_block_t *nodes;
+  mpc_ast_block_t *bytes;
+  mpc_ast_t *root;
+};
+
+typedef struct mpc_ast_arena_t mpc_ast_arena_t;
+
+static mpc_ast_arena_t *mpc_ast_arena_new(void) {
+  return calloc(1, sizeof(mpc_ast_arena_t));
+}
+
+static void mpc_ast_blocks_delete(mpc_ast_block_t *b) {
+  mpc_ast_block_t *n;
+  while (b) { n = b->next; free(b); b = n; }
+}
+
+static void mpc_ast_arena_delete(mpc_ast_arena_t *a) {
+  mpc_ast_blocks_delete(a->nodes);
+  mpc_ast_blocks_delete(a->bytes);
+  free(a);
+}
+
+static void *mpc_ast_blocks_alloc(mpc_ast_block_t **l, size_t n, size_t min, size_t max) {
+
+  mpc_ast_block_t *b = *l;
+  size_t size;
+
+  if (b == NULL || b->used + n > b->size) {
+    size = b ? b->size * 2 : min;
+    if (size > max) { size = max; }
+    if (size < n) { size = n; }
+    b = malloc(sizeof(mpc_ast_block_t) + size);
+    b->next = *l;
+    b->size = size;
+    b->used = 0;
+    *l = b;
+  }
+
+  b->used += n;
+  return (char*)(b + 1) + (b->used - n);
+}
+
+static void *mpc_ast_arena_bytes(mpc_ast_arena_t *a, size_t n) {
+  n = (n + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+  return mpc_ast_blocks_alloc(&a->bytes, n, MPC_AST_BYTES_MIN, MPC_AST_BYTES_MAX);
+}
+
+static mpc_ast_t *mpc_ast_arena_node(mpc_ast_arena_t *a) {
+  mpc_ast_t *r = mpc_ast_blocks_alloc(&a->nodes, sizeof(mpc_ast_t),
+    MPC_AST_NODES_MIN * sizeof(mpc_ast_t), MPC_AST_NODES_MAX * sizeof(mpc_ast_t));
+  r->arena = a;
+  return r;
+}
+
+static int mpc_ast_arena_owns(mpc_ast_arena_t *a, void *p) {
+  mpc_ast_block_t *b;
+  char *s;
+  for (b = a->nodes; b; b = b->next) {
+    s = (char*)(b + 1);
+    if ((char*)p >= s && (char*)p < s + b->used) {
+      return ((char*)p - s) % sizeof(mpc_ast_t) == 0;
+    }
+  }
+  return 0;
+}
+
 /*
 ** Input Type
 */
@@ -71,10 +292,34 @@ enum {
   MPC_INPUT_MEM_NUM = 512
 };
 
+enum {
+  MPC_INPUT_MEMO_NUM   = 4096,
+  MPC_INPUT_MEMO_NODES = 64,
+  MPC_INPUT_TAGS_NUM   = 64
+};
+
 typedef struct {
   char mem[64];
 } mpc_mem_t;
 
+typedef struct {
+  mpc_parser_t *parser;
+  long pos;
+  int success;
+  mpc_state_t state;
+  char last;
+  mpc_val_t *output;
+  mpc_err_t *error;
+  mpc_err_t *merged;
+} mpc_memo_t;
+
+typedef struct {
+  int kind;
+  const char *x;
+  const char *y;
+  char *tag;
+} mpc_tag_join_t;
+
 typedef struct {
 
   int type;
@@ -82,10 +327,12 @@ typedef struct {
   mpc_state_t state;
 
   char *string;
+  size_t length;
   char *buffer;
   FILE *file;
 
   int suppress;
+  int lazy;
   int backtrack;
   int marks_slots;
   int marks_num;
@@ -95,9 +342,15 @@ typedef struct {
   char last;
 
   size_t mem_index;
+  size_t mem_used;
   char mem_full[MPC_INPUT_MEM_NUM];
   mpc_mem_t mem[MPC_INPUT_MEM_NUM];
 
+  mpc_memo_t *memo;
+
+  mpc_ast_arena_t *arena;
+  mpc_tag_join_t tags[MPC_INPUT_TAGS_NUM];
+
 } mpc_input_t;
 
 static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
@@ -110,12 +363,14 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
 
   i->state = mpc_state_new();
 
-  i->string = malloc(strlen(string) + 1);
+  i->length = strlen(string);
+  i->string = malloc(i->length + 1);
   strcpy(i->string, string);
   i->buffer = NULL;
   i->file = NULL;
 
   i->suppress = 0;
+  i->lazy = 0;
   i->backtrack = 1;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
@@ -124,8 +379,14 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->last = '\0';
 
   i->mem_index = 0;
+  i->mem_used = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
+  i->memo = NULL;
+
+  i->arena = NULL;
+  memset(i->tags, 0, sizeof(mpc_tag_join_t) * MPC_INPUT_TAGS_NUM);
+
   return i;
 }
 
@@ -142,10 +403,12 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->string = malloc(length + 1);
   strncpy(i->string, string, length);
   i->string[length] = '\0';
+  i->length = strlen(i->string);
   i->buffer = NULL;
   i->file = NULL;
 
   i->suppress = 0;
+  i->lazy = 0;
   i->backtrack = 1;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
@@ -154,8 +417,14 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->last = '\0';
 
   i->mem_index = 0;
+  i->mem_used = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
+  i->memo = NULL;
+
+  i->arena = NULL;
+  memset(i->tags, 0, sizeof(mpc_tag_join_t) * MPC_INPUT_TAGS_NUM);
+
   return i;
 
 }
@@ -171,10 +440,12 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->state = mpc_state_new();
 
   i->string = NULL;
+  i->length = 0;
   i->buffer = NULL;
   i->file = pipe;
 
   i->suppress = 0;
+  i->lazy = 0;
   i->backtrack = 1;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
@@ -183,8 +454,14 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->last = '\0';
 
   i->mem_index = 0;
+  i->mem_used = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
+  i->memo = NULL;
+
+  i->arena = NULL;
+  memset(i->tags, 0, sizeof(mpc_tag_join_t) * MPC_INPUT_TAGS_NUM);
+
   return i;
 
 }
@@ -199,10 +476,12 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->state = mpc_state_new();
 
   i->string = NULL;
+  i->length = 0;
   i->buffer = NULL;
   i->file = file;
 
   i->suppress = 0;
+  i->lazy = 0;
   i->backtrack = 1;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
@@ -211,15 +490,25 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->last = '\0';
 
   i->mem_index = 0;
+  i->mem_used = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
+  i->memo = NULL;
+
+  i->arena = NULL;
+  memset(i->tags, 0, sizeof(mpc_tag_join_t) * MPC_INPUT_TAGS_NUM);
+
   return i;
 }
 
+static void mpc_input_memo_delete(mpc_input_t *i);
+
 static void mpc_input_delete(mpc_input_t *i) {
 
   free(i->filename);
 
+  mpc_input_memo_delete(i);
+
   if (i->type == MPC_INPUT_STRING) { free(i->string); }
   if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
 
@@ -240,11 +529,15 @@ static void *mpc_malloc(mpc_input_t *i, size_t n) {
 
   if (n > sizeof(mpc_mem_t)) { return malloc(n); }
 
+  /* Deeply nested parses can hold every slot; don't scan a full pool */
+  if (i->mem_used == MPC_INPUT_MEM_NUM) { return malloc(n); }
+
   j = i->mem_index;
   do {
     if (!i->mem_full[i->mem_index]) {
       p = (void*)(i->mem + i->mem_index);
       i->mem_full[i->mem_index] = 1;
+      i->mem_used++;
       i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
       return p;
     }
@@ -265,6 +558,7 @@ static void mpc_free(mpc_input_t *i, void *p) {
   if (!mpc_mem_ptr(i, p)) { free(p); return; }
   j = ((size_t)(((char*)p) - ((char*)i->mem))) / sizeof(mpc_mem_t);
   i->mem_full[j] = 0;
+  i->mem_used--;
 }
 
 static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
@@ -335,8 +629,9 @@ static void mpc_input_unmark(mpc_input_t *i) {
     i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
   }
 
+  /* Only hand back what was read ahead but not consumed */
   if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    for (j = strlen(i->buffer) - 1; j >= 0; j--)
+    for (j = strlen(i->buffer) - 1; j >= i->state.pos - i->marks[0].pos; j--)
       ungetc(i->buffer[j], i->file);
 
     free(i->buffer);
@@ -568,6 +863,175 @@ static mpc_state_t *mpc_input_state_copy(mpc_input_t *i) {
   return r;
 }
 
+/*
+** Spans
+**
+** A span is a set of characters which some
+** parser is known to accept one at a time,
+** producing each character as its output.
+** When such a parser is repeated under a
+** string fold the whole run can be consumed
+** in one go rather than by calling it once
+** per character.
+**
+** Sets with only a handful of characters in
+** (or out) are scanned 16 or 32 bytes at a
+** time using SSE2 or AVX2 where available.
+** Everything else falls back to a table.
+*/
+
+enum {
+  MPC_SPAN_TABLE   = 0,
+  MPC_SPAN_ACCEPTS = 1,
+  MPC_SPAN_STOPS   = 2
+};
+
+enum {
+  MPC_SPAN_CHARS_MAX = 8
+};
+
+typedef struct {
+  unsigned char set[32];
+  int mode;
+  int num;
+  char chars[MPC_SPAN_CHARS_MAX];
+} mpc_span_t;
+
+static int mpc_span_has(mpc_span_t *s, char c) {
+  unsigned char x = (unsigned char)c;
+  return (s->set[x >> 3] >> (x & 7)) & 1;
+}
+
+static void mpc_span_add(mpc_span_t *s, char c) {
+  unsigned char x = (unsigned char)c;
+  s->set[x >> 3] |= (unsigned char)(1 << (x & 7));
+}
+
+static void mpc_span_mode(mpc_span_t *s) {
+
+  int c, in = 0;
+
+  /* The terminator is never part of a span */
+  s->set[0] &= (unsigned char)~1;
+
+  for (c = 1; c < 256; c++) { in += mpc_span_has(s, (char)c); }
+
+  s->num = 0;
+  if (in <= MPC_SPAN_CHARS_MAX) {
+    s->mode = MPC_SPAN_ACCEPTS;
+    for (c = 1; c < 256; c++) {
+      if (mpc_span_has(s, (char)c)) { s->chars[s->num++] = (char)c; }
+    }
+  } else if (255 - in + 1 <= MPC_SPAN_CHARS_MAX) {
+    s->mode = MPC_SPAN_STOPS;
+    for (c = 0; c < 256; c++) {
+      if (!mpc_span_has(s, (char)c)) { s->chars[s->num++] = (char)c; }
+    }
+  } else {
+    s->mode = MPC_SPAN_TABLE;
+  }
+
+}
+
+#if defined(__AVX2__) || defined(__SSE2__)
+static int mpc_span_first_bit(unsigned int bits) {
+#if defined(__GNUC__)
+  return __builtin_ctz(bits);
+#else
+  int j = 0;
+  while (!(bits & 1)) { bits >>= 1; j++; }
+  return j;
+#endif
+}
+#endif
+
+/* Length of the prefix of the `n` bytes at `x` which are in the span */
+static size_t mpc_span_scan(mpc_span_t *s, const char *x, size_t n) {
+
+  size_t j = 0;
+  unsigned int bits;
+  int k;
+
+#if defined(__AVX2__)
+  if (s->mode != MPC_SPAN_TABLE) {
+    __m256i cs[MPC_SPAN_CHARS_MAX], v, m;
+    for (k = 0; k < s->num; k++) { cs[k] = _mm256_set1_epi8(s->chars[k]); }
+    while (j + 32 <= n) {
+      v = _mm256_loadu_si256((const __m256i*)(x + j));
+      m = _mm256_setzero_si256();
+      for (k = 0; k < s->num; k++) { m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, cs[k])); }
+      bits = (unsigned int)_mm256_movemask_epi8(m);
+      if (s->mode == MPC_SPAN_ACCEPTS) { bits = ~bits; }
+      if (bits) { return j + mpc_span_first_bit(bits); }
+      j += 32;
+    }
+  }
+#elif defined(__SSE2__)
+  if (s->mode != MPC_SPAN_TABLE) {
+    __m128i cs[MPC_SPAN_CHARS_MAX], v, m;
+    for (k = 0; k < s->num; k++) { cs[k] = _mm_set1_epi8(s->chars[k]); }
+    while (j + 16 <= n) {
+      v = _mm_loadu_si128((const __m128i*)(x + j));
+      m = _mm_setzero_si128();
+      for (k = 0; k < s->num; k++) { m = _mm_or_si128(m, _mm_cmpeq_epi8(v, cs[k])); }
+      bits = (unsigned int)_mm_movemask_epi8(m);
+      if (s->mode == MPC_SPAN_ACCEPTS) { bits = ~bits & 0xFFFF; }
+      if (bits) { return j + mpc_span_first_bit(bits); }
+      j += 16;
+    }
+  }
+#else
+  (void)bits; (void)k;
+#endif
+
+  while (j < n && mpc_span_has(s, x[j])) { j++; }
+  return j;
+}
+
+/* Consumes the longest run of span characters, returning NULL if empty */
+static char *mpc_input_span(mpc_input_t *i, mpc_span_t *s) {
+
+  char *o, *x, *y;
+  size_t n, slots;
+  char c;
+
+  if (i->type == MPC_INPUT_STRING) {
+
+    if ((size_t)i->state.pos >= i->length) { return NULL; }
+    n = mpc_span_scan(s, i->string + i->state.pos, i->length - i->state.pos);
+    if (n == 0) { return NULL; }
+
+    o = mpc_malloc(i, n + 1);
+    memcpy(o, i->string + i->state.pos, n);
+    o[n] = '\0';
+
+    x = o;
+    while ((y = memchr(x, '\n', n - (x - o)))) {
+      i->state.row++;
+      x = y + 1;
+    }
+    i->state.col = x == o ? i->state.col + (long)n : (long)(n - (x - o));
+    i->state.pos += (long)n;
+    i->last = o[n-1];
+    return o;
+  }
+
+  o = NULL; n = 0; slots = 0;
+  while (!mpc_input_terminated(i)) {
+    c = mpc_input_getc(i);
+    if (!mpc_span_has(s, c)) { mpc_input_failure(i, c); break; }
+    mpc_input_success(i, c, NULL);
+    if (n + 2 > slots) {
+      slots = slots ? slots * 2 : 16;
+      o = mpc_realloc(i, o, slots);
+    }
+    o[n++] = c;
+  }
+
+  if (o) { o[n] = '\0'; }
+  return o;
+}
+
 /*
 ** Error Type
 */
@@ -664,7 +1128,7 @@ char *mpc_err_string(mpc_err_t *x) {
 
 static mpc_err_t *mpc_err_new(mpc_input_t *i, const char *expected) {
   mpc_err_t *x;
-  if (i->suppress) { return NULL; }
+  if (i->suppress || i->lazy) { return NULL; }
   x = mpc_malloc(i, sizeof(mpc_err_t));
   x->filename = mpc_malloc(i, strlen(i->filename) + 1);
   strcpy(x->filename, i->filename);
@@ -680,7 +1144,7 @@ static mpc_err_t *mpc_err_new(mpc_input_t *i, const char *expected) {
 
 static mpc_err_t *mpc_err_fail(mpc_input_t *i, const char *failure) {
   mpc_err_t *x;
-  if (i->suppress) { return NULL; }
+  if (i->suppress || i->lazy) { return NULL; }
   x = mpc_malloc(i, sizeof(mpc_err_t));
   x->filename = mpc_malloc(i, strlen(i->filename) + 1);
   strcpy(x->filename, i->filename);
@@ -728,6 +1192,29 @@ static mpc_err_t *mpc_err_export(mpc_input_t *i, mpc_err_t *x) {
   return mpc_export(i, x);
 }
 
+static mpc_err_t *mpc_err_copy(mpc_input_t *i, mpc_err_t *x) {
+  int j;
+  mpc_err_t *y;
+  if (x == NULL) { return NULL; }
+  y = mpc_malloc(i, sizeof(mpc_err_t));
+  y->state = x->state;
+  y->received = x->received;
+  y->filename = mpc_malloc(i, strlen(x->filename) + 1);
+  strcpy(y->filename, x->filename);
+  y->failure = NULL;
+  if (x->failure) {
+    y->failure = mpc_malloc(i, strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
+  }
+  y->expected_num = x->expected_num;
+  y->expected = mpc_malloc(i, sizeof(char*) * (x->expected_num + 1));
+  for (j = 0; j < x->expected_num; j++) {
+    y->expected[j] = mpc_malloc(i, strlen(x->expected[j]) + 1);
+    strcpy(y->expected[j], x->expected[j]);
+  }
+  return y;
+}
+
 static int mpc_err_contains_expected(mpc_input_t *i, mpc_err_t *x, char *expected) {
   int j;
   (void)i;
@@ -861,6 +1348,7 @@ static mpc_err_t *mpc_err_count(mpc_input_t *i, mpc_err_t *x, int n) {
   mpc_err_t *y;
   int digits = n/10 + 1;
   char *prefix;
+  if (x == NULL) { return NULL; }
   prefix = mpc_malloc(i, digits + strlen(" of ") + 1);
   if (!prefix) {
     return NULL;
@@ -935,7 +1423,7 @@ typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_t f; char *e; } mpc_p
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_with_t f; void *d; char *e; } mpc_pdata_check_with_t;
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
-typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
+typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; mpc_span_t *span; } mpc_pdata_repeat_t;
 typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_parser_t *sep; } mpc_pdata_sepby1;
@@ -966,11 +1454,24 @@ struct mpc_parser_t {
   mpc_pdata_t data;
   char type;
   char retained;
+  char memo;
 };
 
+/*
+** While a parse builds its AST in an arena a
+** generic `free` may be handed one of its nodes;
+** those are released with the arena instead.
+*/
+
+static int mpc_input_arena_owns(mpc_input_t *i, mpc_val_t *x) {
+  return i->arena && x && mpc_ast_arena_owns(i->arena, x);
+}
+
 static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
   int j;
-  for (j = 0; j < n; j++) { if (j != x) { mpc_free(i, xs[j]); } }
+  for (j = 0; j < n; j++) {
+    if (j != x && !mpc_input_arena_owns(i, xs[j])) { mpc_free(i, xs[j]); }
+  }
   return xs[x];
 }
 
@@ -997,6 +1498,105 @@ static mpc_val_t *mpcf_input_state_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
   return a;
 }
 
+static char *mpc_input_tag_join(mpc_input_t *i, int kind, const char *x, const char *y) {
+  size_t h = ((size_t)x >> 3) ^ (((size_t)y >> 3) * 31) ^ (size_t)kind;
+  mpc_tag_join_t *c = &i->tags[h % MPC_INPUT_TAGS_NUM];
+  if (c->tag == NULL || c->kind != kind || c->x != x || c->y != y) {
+    c->kind = kind;
+    c->x = x;
+    c->y = y;
+    c->tag = mpc_tag_join(kind, x, y);
+  }
+  return c->tag;
+}
+
+static mpc_ast_t *mpc_input_ast_new(mpc_input_t *i, char *tag, const char *c, size_t n) {
+  mpc_ast_t *a;
+  if (i->arena) {
+    a = mpc_ast_arena_node(i->arena);
+    a->contents = mpc_ast_arena_bytes(i->arena, n + 1);
+  } else {
+    a = malloc(sizeof(mpc_ast_t));
+    a->contents = malloc(n + 1);
+    a->arena = NULL;
+  }
+  memcpy(a->contents, c, n + 1);
+  a->tag = tag;
+  a->state = mpc_state_new();
+  a->children_num = 0;
+  a->children = NULL;
+  return a;
+}
+
+static mpc_ast_t **mpc_input_ast_children(mpc_input_t *i, int n) {
+  if (n == 0) { return NULL; }
+  if (i->arena) { return mpc_ast_arena_bytes(i->arena, sizeof(mpc_ast_t*) * n); }
+  return malloc(sizeof(mpc_ast_t*) * n);
+}
+
+static mpc_ast_t *mpc_input_ast_copy(mpc_input_t *i, mpc_ast_t *a) {
+  int j;
+  mpc_ast_t *c;
+  if (a == NULL) { return a; }
+  if (i->arena == NULL) { return mpc_ast_copy(a); }
+  c = mpc_input_ast_new(i, a->tag, a->contents, strlen(a->contents));
+  c->state = a->state;
+  c->children_num = a->children_num;
+  c->children = mpc_input_ast_children(i, a->children_num);
+  for (j = 0; j < a->children_num; j++) {
+    c->children[j] = mpc_input_ast_copy(i, a->children[j]);
+  }
+  return c;
+}
+
+static void mpc_ast_delete_no_children(mpc_ast_t *a);
+
+static mpc_val_t *mpcf_input_fold_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
+
+  int j, k, m = 0;
+  mpc_ast_t **as = (mpc_ast_t**)xs;
+  mpc_ast_t *r, *c;
+
+  if (n == 0) { return NULL; }
+  if (n == 1) { return xs[0]; }
+  if (n == 2 && xs[1] == NULL) { return xs[0]; }
+  if (n == 2 && xs[0] == NULL) { return xs[1]; }
+
+  for (j = 0; j < n; j++) {
+    if (as[j] == NULL) { continue; }
+    m += as[j]->children_num ? as[j]->children_num : 1;
+  }
+
+  r = mpc_input_ast_new(i, mpc_tag_root, "", 0);
+  r->children = mpc_input_ast_children(i, m);
+
+  for (j = 0; j < n; j++) {
+
+    if (as[j] == NULL) { continue; }
+
+    if (as[j]->children_num == 0) {
+      r->children[r->children_num++] = as[j];
+    } else if (as[j]->children_num == 1) {
+      c = as[j]->children[0];
+      c->tag = mpc_input_tag_join(i, MPC_TAG_ROOT, as[j]->tag, c->tag);
+      r->children[r->children_num++] = c;
+      mpc_ast_delete_no_children(as[j]);
+    } else {
+      for (k = 0; k < as[j]->children_num; k++) {
+        r->children[r->children_num++] = as[j]->children[k];
+      }
+      mpc_ast_delete_no_children(as[j]);
+    }
+
+  }
+
+  if (r->children_num) {
+    r->state = r->children[0]->state;
+  }
+
+  return r;
+}
+
 static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t **xs) {
   int j;
   if (f == mpcf_null)      { return mpcf_null(n, xs); }
@@ -1008,347 +1608,666 @@ static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t
   if (f == mpcf_trd_free)  { return mpcf_input_trd_free(i, n, xs); }
   if (f == mpcf_strfold)   { return mpcf_input_strfold(i, n, xs); }
   if (f == mpcf_state_ast) { return mpcf_input_state_ast(i, n, xs); }
+  if (f == mpcf_fold_ast)  { return mpcf_input_fold_ast(i, n, xs); }
   for (j = 0; j < n; j++) { xs[j] = mpc_export(i, xs[j]); }
   return f(j, xs);
 }
 
 static mpc_val_t *mpcf_input_free(mpc_input_t *i, mpc_val_t *x) {
-  mpc_free(i, x);
+  if (!mpc_input_arena_owns(i, x)) { mpc_free(i, x); }
   return NULL;
 }
 
 static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
+  mpc_ast_t *a = mpc_input_ast_new(i, mpc_tag_empty, c, strlen(c));
   mpc_free(i, c);
   return a;
 }
 
+static mpc_val_t *mpcf_input_add_root(mpc_input_t *i, mpc_val_t *x) {
+  mpc_ast_t *a = x;
+  mpc_ast_t *r;
+  if (a == NULL) { return a; }
+  if (a->children_num == 0) { return a; }
+  if (a->children_num == 1) { return a; }
+  r = mpc_input_ast_new(i, mpc_tag_root, "", 0);
+  r->children = mpc_input_ast_children(i, 1);
+  r->children[0] = a;
+  r->children_num = 1;
+  return r;
+}
+
 static mpc_val_t *mpc_parse_apply(mpc_input_t *i, mpc_apply_t f, mpc_val_t *x) {
   if (f == mpcf_free)     { return mpcf_input_free(i, x); }
   if (f == mpcf_str_ast)  { return mpcf_input_str_ast(i, x); }
+  if (f == (mpc_apply_t)mpc_ast_add_root) { return mpcf_input_add_root(i, x); }
   return f(mpc_export(i, x));
 }
 
 static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, mpc_apply_to_t f, mpc_val_t *x, mpc_val_t *d) {
+  mpc_ast_t *a = x;
+  if (f == (mpc_apply_to_t)mpc_ast_tag && a) {
+    a->tag = mpc_input_tag_join(i, MPC_TAG_SET, d, NULL);
+    return a;
+  }
+  if (f == (mpc_apply_to_t)mpc_ast_add_tag && a) {
+    a->tag = mpc_input_tag_join(i, MPC_TAG_ADD, d, a->tag);
+    return a;
+  }
   return f(mpc_export(i, x), d);
 }
 
 static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
-  if (d == free) { mpc_free(i, x); return; }
+  if (d == free) {
+    if (!mpc_input_arena_owns(i, x)) { mpc_free(i, x); }
+    return;
+  }
   d(mpc_export(i, x));
 }
 
 enum {
-  MPC_PARSE_STACK_MIN = 4
+  MPC_PARSE_STACK_MIN = 4,
+  MPC_PARSE_FRAMES_MIN = 64
 };
 
-#define MPC_SUCCESS(x) r->output = x; return 1
-#define MPC_FAILURE(x) r->error = x; return 0
-#define MPC_PRIMITIVE(x) \
-  if (x) { MPC_SUCCESS(r->output); } \
-  else { MPC_FAILURE(NULL); }
+/*
+** The parse engine does not recurse on the C
+** stack. Each active parser is a frame on an
+** explicit, heap allocated work stack which
+** records how far through its parser it has
+** got (the stage). A frame "calls" a child by
+** pushing it and resumes once the child has
+** left its result in `ok` and `res`.
+**
+** This means nesting depth is limited only by
+** available memory.
+*/
 
-#define MPC_MAX_RECURSION_DEPTH 1000
+enum {
+  MPC_STAGE_ENTER = 0,
+  MPC_STAGE_START = 1,
+  MPC_STAGE_CHILD = 2,
+  MPC_STAGE_SEP   = 3,
+  MPC_STAGE_ITEM  = 4
+};
 
-static mpc_result_t *mpc_grow_results(mpc_input_t *i, int j, mpc_result_t *results_stk, mpc_result_t *results){
-  mpc_result_t *tmp_results = results;
+typedef struct {
+  mpc_parser_t *p;
+  int stage;
+  int j;
+  int memo;
+  long pos;
+  mpc_err_t *outer;
+  int results_slots;
+  mpc_result_t *results;
+} mpc_frame_t;
 
-  if (j == MPC_PARSE_STACK_MIN) {
-    int results_slots = j + j / 2;
-    tmp_results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-    memcpy(tmp_results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-  } else if (j >= MPC_PARSE_STACK_MIN) {
-    int results_slots = j + j / 2;
-    tmp_results = mpc_realloc(i, tmp_results, sizeof(mpc_result_t) * results_slots);
+typedef struct {
+  int num;
+  int slots;
+  mpc_frame_t *frames;
+} mpc_stack_t;
+
+static void mpc_stack_push(mpc_stack_t *s, mpc_parser_t *p) {
+  mpc_frame_t *f;
+  if (s->num == s->slots) {
+    s->slots = s->slots * 2;
+    s->frames = realloc(s->frames, sizeof(mpc_frame_t) * s->slots);
+  }
+  f = &s->frames[s->num++];
+  f->p = p;
+  f->stage = MPC_STAGE_ENTER;
+  f->j = 0;
+  f->memo = 0;
+  f->pos = 0;
+  f->outer = NULL;
+  f->results_slots = 0;
+  f->results = NULL;
+}
+
+static void mpc_frame_results(mpc_input_t *i, mpc_frame_t *f, int n) {
+  f->results_slots = n > MPC_PARSE_STACK_MIN ? n : MPC_PARSE_STACK_MIN;
+  f->results = mpc_malloc(i, sizeof(mpc_result_t) * f->results_slots);
+}
+
+static void mpc_frame_add_result(mpc_input_t *i, mpc_frame_t *f, mpc_val_t *x) {
+  if (f->j == f->results_slots) {
+    f->results_slots = f->j + f->j / 2;
+    f->results = mpc_realloc(i, f->results, sizeof(mpc_result_t) * f->results_slots);
   }
+  f->results[f->j++].output = x;
+}
 
-  return tmp_results;
+static mpc_val_t *mpc_frame_fold(mpc_input_t *i, mpc_frame_t *f, mpc_fold_t fold) {
+  return mpc_parse_fold(i, fold, f->j, (mpc_val_t**)f->results);
 }
 
-static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+static void mpc_frame_dtor(mpc_input_t *i, mpc_frame_t *f, mpc_dtor_t *dxs, mpc_dtor_t dx) {
+  int k;
+  for (k = 0; k < f->j; k++) {
+    mpc_parse_dtor(i, dxs ? dxs[k] : dx, f->results[k].output);
+  }
+}
 
-  int j = 0, k = 0;
-  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
-  mpc_result_t *results;
+/*
+** Packrat Memoisation
+**
+** Rules defined with `MPCA_LANG_PACKRAT` remember
+** their result at each input position so that
+** backtracking through an alternation never
+** parses the same span with the same rule twice.
+**
+** The table is direct mapped on (rule, position)
+** so memory use is bounded; a colliding entry
+** simply evicts the older one. Along with the
+** result we keep the errors the rule merged in
+** so that error reporting is unchanged on a hit.
+**
+** Memoised rules always produce an AST so results
+** are stored and handed out as copies. Copying a
+** large subtree at every level of nesting would
+** be quadratic, so only small results are kept.
+*/
 
-  if (depth == MPC_MAX_RECURSION_DEPTH)
-  {
-    MPC_FAILURE(mpc_err_fail(i, "Maximum recursion depth exceeded!"));
+static mpc_memo_t *mpc_input_memo_slot(mpc_input_t *i, mpc_parser_t *p, long pos) {
+  size_t h;
+  if (i->memo == NULL) { i->memo = calloc(MPC_INPUT_MEMO_NUM, sizeof(mpc_memo_t)); }
+  h = ((size_t)p >> 4) ^ ((size_t)pos * 2654435761u);
+  return &i->memo[h % MPC_INPUT_MEMO_NUM];
+}
+
+static void mpc_memo_clear(mpc_memo_t *m) {
+  if (m->parser == NULL) { return; }
+  if (m->output) { mpc_ast_delete(m->output); }
+  if (m->error)  { mpc_err_delete(m->error); }
+  if (m->merged) { mpc_err_delete(m->merged); }
+  memset(m, 0, sizeof(mpc_memo_t));
+}
+
+static void mpc_input_memo_delete(mpc_input_t *i) {
+  int j;
+  if (i->memo == NULL) { return; }
+  for (j = 0; j < MPC_INPUT_MEMO_NUM; j++) { mpc_memo_clear(&i->memo[j]); }
+  free(i->memo);
+  i->memo = NULL;
+}
+
+static int mpc_memo_small(mpc_ast_t *a, int *budget) {
+  int j;
+  if (a == NULL) { return 1; }
+  if (--(*budget) < 0) { return 0; }
+  for (j = 0; j < a->children_num; j++) {
+    if (!mpc_memo_small(a->children[j], budget)) { return 0; }
   }
+  return 1;
+}
 
-  switch (p->type) {
+static int mpc_input_memo_enabled(mpc_input_t *i, mpc_parser_t *p) {
+  return p->memo && i->backtrack > 0 && !i->suppress && i->type != MPC_INPUT_PIPE;
+}
+
+static int mpc_parse_memo_lookup(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+
+  mpc_memo_t *m = mpc_input_memo_slot(i, p, i->state.pos);
+
+  if (m->parser != p || m->pos != i->state.pos) { return -1; }
+
+  if (m->merged) { *e = mpc_err_merge(i, *e, mpc_err_copy(i, m->merged)); }
+  i->state = m->state;
+  i->last = m->last;
+  if (i->type == MPC_INPUT_FILE) { fseek(i->file, i->state.pos, SEEK_SET); }
+  if (m->success) {
+    r->output = mpc_input_ast_copy(i, m->output);
+  } else {
+    r->error = mpc_err_copy(i, m->error);
+  }
+  return m->success;
+}
+
+static void mpc_parse_memo_store(mpc_input_t *i, mpc_frame_t *f, int x, mpc_result_t *r, mpc_err_t **e) {
+
+  int budget = MPC_INPUT_MEMO_NODES;
+  mpc_memo_t *m;
+
+  if (x && !mpc_memo_small(r->output, &budget)) {
+    *e = mpc_err_merge(i, f->outer, *e);
+    return;
+  }
+
+  m = mpc_input_memo_slot(i, f->p, f->pos);
+  mpc_memo_clear(m);
+  m->parser = f->p;
+  m->pos = f->pos;
+  m->success = x;
+  m->state = i->state;
+  m->last = i->last;
+  m->merged = *e ? mpc_err_export(i, mpc_err_copy(i, *e)) : NULL;
+  if (x) {
+    m->output = mpc_ast_copy(r->output);
+  } else if (r->error) {
+    m->error = mpc_err_export(i, mpc_err_copy(i, r->error));
+  }
 
-    /* Basic Parsers */
+  *e = mpc_err_merge(i, f->outer, *e);
+}
 
-    case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
-    case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
-    case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
-    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
-    case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
-    case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&r->output));
-    case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&r->output));
+#define MPC_SUCCESS(x) { res.output = (x); ok = 1; goto done; }
+#define MPC_FAILURE(x) { res.error = (x); ok = 0; goto done; }
+#define MPC_PASS()     goto done
+#define MPC_PRIMITIVE(x) \
+  if (x) { MPC_SUCCESS(res.output); } \
+  else { MPC_FAILURE(NULL); }
+#define MPC_CALL(q, s) { f->stage = (s); mpc_stack_push(&stk, (q)); continue; }
+
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+
+  int ok = 0, hit;
+  mpc_result_t res;
+  mpc_frame_t *f;
+  mpc_parser_t *q;
+  mpc_stack_t stk;
+
+  res.output = NULL;
+  stk.num = 0;
+  stk.slots = MPC_PARSE_FRAMES_MIN;
+  stk.frames = malloc(sizeof(mpc_frame_t) * stk.slots);
+  mpc_stack_push(&stk, p);
+
+  while (stk.num) {
+
+    f = &stk.frames[stk.num-1];
+    q = f->p;
+
+    if (f->stage == MPC_STAGE_ENTER) {
+      f->stage = MPC_STAGE_START;
+      if (mpc_input_memo_enabled(i, q)) {
+        hit = mpc_parse_memo_lookup(i, q, &res, e);
+        if (hit != -1) { ok = hit; MPC_PASS(); }
+        f->memo = 1;
+        f->pos = i->state.pos;
+        f->outer = *e;
+        *e = NULL;
+      }
+    }
 
-    /* Other parsers */
+    switch (q->type) {
+
+      /* Basic Parsers */
+
+      case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&res.output));
+      case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, q->data.single.x, (char**)&res.output));
+      case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, q->data.range.x, q->data.range.y, (char**)&res.output));
+      case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, q->data.string.x, (char**)&res.output));
+      case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, q->data.string.x, (char**)&res.output));
+      case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, q->data.satisfy.f, (char**)&res.output));
+      case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, q->data.string.x, (char**)&res.output));
+      case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, q->data.anchor.f, (char**)&res.output));
+      case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&res.output));
+      case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&res.output));
+
+      /* Other parsers */
+
+      case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
+      case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
+      case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, q->data.fail.m));
+      case MPC_TYPE_LIFT:      MPC_SUCCESS(q->data.lift.lf());
+      case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(q->data.lift.x);
+      case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
+
+      /* Application Parsers */
+
+      case MPC_TYPE_APPLY:
+        if (f->stage == MPC_STAGE_START) { MPC_CALL(q->data.apply.x, MPC_STAGE_CHILD); }
+        if (ok) { MPC_SUCCESS(mpc_parse_apply(i, q->data.apply.f, res.output)); }
+        MPC_PASS();
+
+      case MPC_TYPE_APPLY_TO:
+        if (f->stage == MPC_STAGE_START) { MPC_CALL(q->data.apply_to.x, MPC_STAGE_CHILD); }
+        if (ok) { MPC_SUCCESS(mpc_parse_apply_to(i, q->data.apply_to.f, res.output, q->data.apply_to.d)); }
+        MPC_PASS();
+
+      case MPC_TYPE_CHECK:
+        if (f->stage == MPC_STAGE_START) { MPC_CALL(q->data.check.x, MPC_STAGE_CHILD); }
+        if (!ok) { MPC_PASS(); }
+        if (q->data.check.f(&res.output)) { MPC_SUCCESS(res.output); }
+        mpc_parse_dtor(i, q->data.check.dx, res.output);
+        MPC_FAILURE(mpc_err_fail(i, q->data.check.e));
+
+      case MPC_TYPE_CHECK_WITH:
+        if (f->stage == MPC_STAGE_START) { MPC_CALL(q->data.check_with.x, MPC_STAGE_CHILD); }
+        if (!ok) { MPC_PASS(); }
+        if (q->data.check_with.f(&res.output, q->data.check_with.d)) { MPC_SUCCESS(res.output); }
+        mpc_parse_dtor(i, q->data.check_with.dx, res.output);
+        MPC_FAILURE(mpc_err_fail(i, q->data.check_with.e));
+
+      case MPC_TYPE_EXPECT:
+        if (f->stage == MPC_STAGE_START) {
+          mpc_input_suppress_enable(i);
+          MPC_CALL(q->data.expect.x, MPC_STAGE_CHILD);
+        }
+        mpc_input_suppress_disable(i);
+        if (ok) { MPC_SUCCESS(res.output); }
+        MPC_FAILURE(mpc_err_new(i, q->data.expect.m));
 
-    case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
-    case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
-    case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
-    case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
-    case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
-    case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
+      case MPC_TYPE_PREDICT:
+        if (f->stage == MPC_STAGE_START) {
+          mpc_input_backtrack_disable(i);
+          MPC_CALL(q->data.predict.x, MPC_STAGE_CHILD);
+        }
+        mpc_input_backtrack_enable(i);
+        MPC_PASS();
 
-    /* Application Parsers */
+      /* Optional Parsers */
 
-    case MPC_TYPE_APPLY:
-      if (mpc_parse_run(i, p->data.apply.x, r, e, depth+1)) {
-        MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output));
-      } else {
-        MPC_FAILURE(r->output);
-      }
+      /* TODO: Update Not Error Message */
 
-    case MPC_TYPE_APPLY_TO:
-      if (mpc_parse_run(i, p->data.apply_to.x, r, e, depth+1)) {
-        MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
-      } else {
-        MPC_FAILURE(r->error);
-      }
+      case MPC_TYPE_NOT:
+        if (f->stage == MPC_STAGE_START) {
+          mpc_input_mark(i);
+          mpc_input_suppress_enable(i);
+          MPC_CALL(q->data.not.x, MPC_STAGE_CHILD);
+        }
+        if (ok) {
+          mpc_input_rewind(i);
+          mpc_input_suppress_disable(i);
+          mpc_parse_dtor(i, q->data.not.dx, res.output);
+          MPC_FAILURE(mpc_err_new(i, "opposite"));
+        }
+        mpc_input_unmark(i);
+        mpc_input_suppress_disable(i);
+        MPC_SUCCESS(q->data.not.lf());
+
+      case MPC_TYPE_MAYBE:
+        if (f->stage == MPC_STAGE_START) { MPC_CALL(q->data.not.x, MPC_STAGE_CHILD); }
+        if (ok) { MPC_SUCCESS(res.output); }
+        *e = mpc_err_merge(i, *e, res.error);
+        MPC_SUCCESS(q->data.not.lf());
+
+      /* Repeat Parsers */
+
+      case MPC_TYPE_MANY:
+      case MPC_TYPE_MANY1:
+        if (f->stage == MPC_STAGE_START) {
+          mpc_frame_results(i, f, 0);
+        } else if (ok) {
+          mpc_frame_add_result(i, f, res.output);
+        }
+        if (f->stage == MPC_STAGE_START || ok) {
+          if (q->data.repeat.span) {
+            res.output = mpc_input_span(i, q->data.repeat.span);
+            if (res.output) { mpc_frame_add_result(i, f, res.output); }
+          }
+          MPC_CALL(q->data.repeat.x, MPC_STAGE_CHILD);
+        }
+        if (q->type == MPC_TYPE_MANY1 && f->j == 0) {
+          MPC_FAILURE(mpc_err_many1(i, res.error));
+        }
+        *e = mpc_err_merge(i, *e, res.error);
+        MPC_SUCCESS(mpc_frame_fold(i, f, q->data.repeat.f));
 
-    case MPC_TYPE_CHECK:
-      if (mpc_parse_run(i, p->data.check.x, r, e, depth+1)) {
-        if (p->data.check.f(&r->output)) {
-          MPC_SUCCESS(r->output);
-        } else {
-          mpc_parse_dtor(i, p->data.check.dx, r->output);
-          MPC_FAILURE(mpc_err_fail(i, p->data.check.e));
+      case MPC_TYPE_SEPBY1:
+        if (f->stage == MPC_STAGE_START) {
+          mpc_frame_results(i, f, 0);
+          MPC_CALL(q->data.sepby1.x, MPC_STAGE_ITEM);
         }
-      } else {
-        MPC_FAILURE(r->error);
-      }
+        if (f->stage == MPC_STAGE_SEP && ok) {
+          MPC_CALL(q->data.sepby1.x, MPC_STAGE_ITEM);
+        }
+        if (f->stage == MPC_STAGE_ITEM && ok) {
+          mpc_frame_add_result(i, f, res.output);
+          MPC_CALL(q->data.sepby1.sep, MPC_STAGE_SEP);
+        }
+        if (f->j == 0) {
+          MPC_FAILURE(mpc_err_many1(i, res.error));
+        }
+        *e = mpc_err_merge(i, *e, res.error);
+        MPC_SUCCESS(mpc_frame_fold(i, f, q->data.sepby1.f));
 
-    case MPC_TYPE_CHECK_WITH:
-      if (mpc_parse_run(i, p->data.check_with.x, r, e, depth+1)) {
-        if (p->data.check_with.f(&r->output, p->data.check_with.d)) {
-          MPC_SUCCESS(r->output);
-        } else {
-          mpc_parse_dtor(i, p->data.check.dx, r->output);
-          MPC_FAILURE(mpc_err_fail(i, p->data.check_with.e));
+      case MPC_TYPE_COUNT:
+        if (f->stage == MPC_STAGE_START) {
+          mpc_frame_results(i, f, q->data.repeat.n);
+          MPC_CALL(q->data.repeat.x, MPC_STAGE_CHILD);
         }
-      } else {
-        MPC_FAILURE(r->error);
-      }
+        if (ok) {
+          mpc_frame_add_result(i, f, res.output);
+          if (f->j == q->data.repeat.n) {
+            MPC_SUCCESS(mpc_frame_fold(i, f, q->data.repeat.f));
+          }
+          MPC_CALL(q->data.repeat.x, MPC_STAGE_CHILD);
+        }
+        mpc_frame_dtor(i, f, NULL, q->data.repeat.dx);
+        MPC_FAILURE(mpc_err_count(i, res.error, q->data.repeat.n));
 
-    case MPC_TYPE_EXPECT:
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.expect.x, r, e, depth+1)) {
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_suppress_disable(i);
-        MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
-      }
+      /* Combinatory Parsers */
 
-    case MPC_TYPE_PREDICT:
-      mpc_input_backtrack_disable(i);
-      if (mpc_parse_run(i, p->data.predict.x, r, e, depth+1)) {
-        mpc_input_backtrack_enable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_backtrack_enable(i);
-        MPC_FAILURE(r->error);
-      }
+      case MPC_TYPE_OR:
+        if (f->stage == MPC_STAGE_START) {
+          if (q->data.or.n == 0) { MPC_SUCCESS(NULL); }
+          MPC_CALL(q->data.or.xs[0], MPC_STAGE_CHILD);
+        }
+        if (ok) { MPC_SUCCESS(res.output); }
+        *e = mpc_err_merge(i, *e, res.error);
+        if (++f->j < q->data.or.n) { MPC_CALL(q->data.or.xs[f->j], MPC_STAGE_CHILD); }
+        MPC_FAILURE(NULL);
+
+      case MPC_TYPE_AND:
+        if (f->stage == MPC_STAGE_START) {
+          if (q->data.and.n == 0) { MPC_SUCCESS(NULL); }
+          mpc_frame_results(i, f, q->data.and.n);
+          mpc_input_mark(i);
+          MPC_CALL(q->data.and.xs[0], MPC_STAGE_CHILD);
+        }
+        if (!ok) {
+          mpc_input_rewind(i);
+          mpc_frame_dtor(i, f, q->data.and.dxs, NULL);
+          MPC_PASS();
+        }
+        mpc_frame_add_result(i, f, res.output);
+        if (f->j < q->data.and.n) { MPC_CALL(q->data.and.xs[f->j], MPC_STAGE_CHILD); }
+        mpc_input_unmark(i);
+        MPC_SUCCESS(mpc_frame_fold(i, f, q->data.and.f));
 
-    /* Optional Parsers */
+      /* End */
 
-    /* TODO: Update Not Error Message */
+      default:
 
-    case MPC_TYPE_NOT:
-      mpc_input_mark(i);
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
-        mpc_input_rewind(i);
-        mpc_input_suppress_disable(i);
-        mpc_parse_dtor(i, p->data.not.dx, r->output);
-        MPC_FAILURE(mpc_err_new(i, "opposite"));
-      } else {
-        mpc_input_unmark(i);
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(p->data.not.lf());
-      }
+        MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+    }
 
-    case MPC_TYPE_MAYBE:
-      if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
-        MPC_SUCCESS(r->output);
-      } else {
-        *e = mpc_err_merge(i, *e, r->error);
-        MPC_SUCCESS(p->data.not.lf());
-      }
+  done:
 
-    /* Repeat Parsers */
+    /* Frame finished with result in `ok` and `res` */
+    if (f->memo) { mpc_parse_memo_store(i, f, ok, &res, e); }
+    if (f->results) { mpc_free(i, f->results); }
+    stk.num--;
+  }
 
-    case MPC_TYPE_MANY:
+  free(stk.frames);
 
-      results = results_stk;
+  *r = res;
+  return ok;
 
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        results = mpc_grow_results(i, j, results_stk, results);
-      }
+}
 
-      *e = mpc_err_merge(i, *e, results[j].error);
+#undef MPC_SUCCESS
+#undef MPC_FAILURE
+#undef MPC_PASS
+#undef MPC_PRIMITIVE
+#undef MPC_CALL
 
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-        if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+/*
+** A parse may only build its AST in an arena if
+** no user callback could see the nodes: every
+** fold, apply, constructor and destructor in the
+** grammar must be one of the library's own.
+*/
 
-    case MPC_TYPE_MANY1:
+enum {
+  MPC_ARENA_RULES_MAX = 256
+};
 
-      results = results_stk;
+static int mpc_arena_fold(mpc_fold_t f) {
+  return f == mpcf_null || f == mpcf_fst || f == mpcf_snd || f == mpcf_trd
+    || f == mpcf_fst_free || f == mpcf_snd_free || f == mpcf_trd_free
+    || f == mpcf_strfold || f == mpcf_state_ast || f == mpcf_fold_ast;
+}
 
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        results = mpc_grow_results(i, j, results_stk, results);
-      }
+static int mpc_arena_apply(mpc_apply_t f) {
+  return f == mpcf_free || f == mpcf_str_ast || f == (mpc_apply_t)mpc_ast_add_root;
+}
 
-      if (j == 0) {
-        MPC_FAILURE(
-          mpc_err_many1(i, results[j].error);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
+static int mpc_arena_apply_to(mpc_apply_to_t f) {
+  return f == (mpc_apply_to_t)mpc_ast_tag || f == (mpc_apply_to_t)mpc_ast_add_tag;
+}
 
-        *e = mpc_err_merge(i, *e, results[j].error);
+static int mpc_arena_ctor(mpc_ctor_t f) {
+  return f == mpcf_ctor_null || f == mpcf_ctor_str;
+}
 
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      }
+static int mpc_arena_dtor(mpc_dtor_t d) {
+  return d == free || d == mpcf_dtor_null || d == (mpc_dtor_t)mpc_ast_delete;
+}
 
-   case MPC_TYPE_SEPBY1:
+static int mpc_arena_safe(mpc_parser_t *p, mpc_parser_t **seen, int *seen_num) {
 
-      results = results_stk;
+  int j;
 
-      if(mpc_parse_run(i, p->data.sepby1.x, &results[j], e, depth+1)){
-        j++;
-        results = mpc_grow_results(i, j, results_stk, results);
+  if (p->retained) {
+    for (j = 0; j < *seen_num; j++) { if (seen[j] == p) { return 1; } }
+    if (*seen_num == MPC_ARENA_RULES_MAX) { return 0; }
+    seen[(*seen_num)++] = p;
+  }
 
-        while (
-          mpc_parse_run(i, p->data.sepby1.sep, &results[j], e, depth+1) &&
-          mpc_parse_run(i, p->data.sepby1.x, &results[j], e, depth+1)
-        ) {
-          j++;
-          results = mpc_grow_results(i, j, results_stk, results);
-        }
-      }
+  switch (p->type) {
 
-      if (j == 0) {
-        MPC_FAILURE(
-          mpc_err_many1(i, results[j].error);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        *e = mpc_err_merge(i, *e, results[j].error);
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_FAIL:
+    case MPC_TYPE_ANCHOR:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_SATISFY:
+    case MPC_TYPE_STRING:
+    case MPC_TYPE_SOI:
+    case MPC_TYPE_EOI:
+      return 1;
 
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      }
+    case MPC_TYPE_LIFT:
+      return mpc_arena_ctor(p->data.lift.lf);
 
-    case MPC_TYPE_COUNT:
+    case MPC_TYPE_EXPECT:
+      return mpc_arena_safe(p->data.expect.x, seen, seen_num);
 
-      results = p->data.repeat.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
-        : results_stk;
+    case MPC_TYPE_APPLY:
+      return mpc_arena_apply(p->data.apply.f)
+        && mpc_arena_safe(p->data.apply.x, seen, seen_num);
 
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == p->data.repeat.n) { break; }
-      }
+    case MPC_TYPE_APPLY_TO:
+      return mpc_arena_apply_to(p->data.apply_to.f)
+        && mpc_arena_safe(p->data.apply_to.x, seen, seen_num);
 
-      if (j == p->data.repeat.n) {
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        for (k = 0; k < j; k++) {
-          mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
-        }
-        MPC_FAILURE(
-          mpc_err_count(i, results[j].error, p->data.repeat.n);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      }
+    case MPC_TYPE_PREDICT:
+      return mpc_arena_safe(p->data.predict.x, seen, seen_num);
 
-    /* Combinatory Parsers */
+    case MPC_TYPE_NOT:
+      return mpc_arena_ctor(p->data.not.lf) && mpc_arena_dtor(p->data.not.dx)
+        && mpc_arena_safe(p->data.not.x, seen, seen_num);
 
-    case MPC_TYPE_OR:
+    case MPC_TYPE_MAYBE:
+      return mpc_arena_ctor(p->data.not.lf)
+        && mpc_arena_safe(p->data.not.x, seen, seen_num);
 
-      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+    case MPC_TYPE_COUNT:
+      if (!mpc_arena_dtor(p->data.repeat.dx)) { return 0; }
+      /* fallthrough */
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      return mpc_arena_fold(p->data.repeat.f)
+        && mpc_arena_safe(p->data.repeat.x, seen, seen_num);
 
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+    case MPC_TYPE_SEPBY1:
+      return mpc_arena_fold(p->data.sepby1.f)
+        && mpc_arena_safe(p->data.sepby1.x, seen, seen_num)
+        && mpc_arena_safe(p->data.sepby1.sep, seen, seen_num);
 
+    case MPC_TYPE_OR:
       for (j = 0; j < p->data.or.n; j++) {
-        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e, depth+1)) {
-          MPC_SUCCESS(results[j].output;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-        } else {
-          *e = mpc_err_merge(i, *e, results[j].error);
-        }
+        if (!mpc_arena_safe(p->data.or.xs[j], seen, seen_num)) { return 0; }
       }
-
-      MPC_FAILURE(NULL;
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      return 1;
 
     case MPC_TYPE_AND:
-      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
-
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
-
-      mpc_input_mark(i);
+      if (!mpc_arena_fold(p->data.and.f)) { return 0; }
       for (j = 0; j < p->data.and.n; j++) {
-        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e, depth+1)) {
-          mpc_input_rewind(i);
-          for (k = 0; k < j; k++) {
-            mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
-          }
-          MPC_FAILURE(results[j].error;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-        }
+        if (j < p->data.and.n-1 && !mpc_arena_dtor(p->data.and.dxs[j])) { return 0; }
+        if (!mpc_arena_safe(p->data.and.xs[j], seen, seen_num)) { return 0; }
       }
-      mpc_input_unmark(i);
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-
-    /* End */
-
-    default:
+      return 1;
 
-      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+    default: return 0;
   }
+}
 
-  return 0;
-
+static int mpc_arena_enabled(mpc_parser_t *p) {
+  mpc_parser_t *seen[MPC_ARENA_RULES_MAX];
+  int seen_num = 0;
+  return mpc_arena_safe(p, seen, &seen_num);
 }
 
-#undef MPC_SUCCESS
-#undef MPC_FAILURE
-#undef MPC_PRIMITIVE
+/*
+** Errors are only wanted when a parse fails but
+** building them is a large part of the cost of
+** parsing: every failed alternative allocates
+** and merges its expected strings. So the first
+** attempt runs lazily, with errors disabled, and
+** only if it fails is the input rewound and the
+** parse run again to build the error. Pipes can
+** not be rewound so they always build errors.
+*/
 
 int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
-  e->state = mpc_state_invalid();
-  x = mpc_parse_run(i, p, r, &e, 0);
+
+  int x = 0;
+  mpc_err_t *e = NULL;
+  mpc_state_t start = i->state;
+  char last = i->last;
+
+  memset(i->tags, 0, sizeof(mpc_tag_join_t) * MPC_INPUT_TAGS_NUM);
+  i->arena = mpc_arena_enabled(p) ? mpc_ast_arena_new() : NULL;
+
+  if (i->type != MPC_INPUT_PIPE) {
+    i->lazy = 1;
+    x = mpc_parse_run(i, p, r, &e);
+    i->lazy = 0;
+    if (!x) {
+      i->state = start;
+      i->last = last;
+      if (i->type == MPC_INPUT_FILE) { fseek(i->file, i->state.pos, SEEK_SET); }
+      mpc_input_memo_delete(i);
+    }
+  }
+
+  if (!x) {
+    e = mpc_err_fail(i, "Unknown Error");
+    e->state = mpc_state_invalid();
+    x = mpc_parse_run(i, p, r, &e);
+  }
+
   if (x) {
     mpc_err_delete_internal(i, e);
     r->output = mpc_export(i, r->output);
   } else {
     r->error = mpc_err_export(i, mpc_err_merge(i, e, r->error));
   }
+  if (i->arena && x && mpc_ast_arena_owns(i->arena, r->output)) {
+    i->arena->root = r->output;
+  } else if (i->arena) {
+    mpc_ast_arena_delete(i->arena);
+  }
+  i->arena = NULL;
   return x;
 }
 
@@ -1387,6 +2306,8 @@ int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
 
   FILE *f = fopen(filename, "rb");
+  char *buffer;
+  size_t length, slots;
   int res;
 
   if (f == NULL) {
@@ -1395,11 +2316,68 @@ int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
     return 0;
   }
 
-  res = mpc_parse_file(filename, f, p, r);
+  /*
+  ** Parse the contents from memory. File inputs seek
+  ** back after every failed character, which does not
+  ** work on pipes, while string inputs can also scan
+  ** spans in bulk.
+  */
+  length = 0; slots = 4096;
+  buffer = malloc(slots);
+  while (1) {
+    length += fread(buffer + length, 1, slots - length - 1, f);
+    if (length < slots - 1) { break; }
+    slots *= 2;
+    buffer = realloc(buffer, slots);
+  }
+  buffer[length] = '\0';
   fclose(f);
+
+  res = mpc_nparse(filename, buffer, length, p, r);
+  free(buffer);
   return res;
 }
 
+/*
+** Streaming
+**
+** A stream keeps its input open between parses
+** so that a caller can read one value at a time
+** from a large file or pipe, each parse starting
+** where the previous one finished.
+*/
+
+struct mpc_stream_t {
+  mpc_input_t *input;
+};
+
+mpc_stream_t *mpc_stream_file(const char *filename, FILE *file) {
+  mpc_stream_t *s = malloc(sizeof(mpc_stream_t));
+  s->input = mpc_input_new_file(filename, file);
+  return s;
+}
+
+mpc_stream_t *mpc_stream_pipe(const char *filename, FILE *pipe) {
+  mpc_stream_t *s = malloc(sizeof(mpc_stream_t));
+  s->input = mpc_input_new_pipe(filename, pipe);
+  return s;
+}
+
+int mpc_stream_parse(mpc_stream_t *s, mpc_parser_t *p, mpc_result_t *r) {
+  /* Memoised results never outlive the value they were made for */
+  mpc_input_memo_delete(s->input);
+  return mpc_parse_input(s->input, p, r);
+}
+
+int mpc_stream_end(mpc_stream_t *s) {
+  return mpc_input_terminated(s->input);
+}
+
+void mpc_stream_delete(mpc_stream_t *s) {
+  mpc_input_delete(s->input);
+  free(s);
+}
+
 /*
 ** Building a Parser
 */
@@ -1459,6 +2437,7 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_MANY1:
     case MPC_TYPE_COUNT:
       mpc_undefine_unretained(p->data.repeat.x, 0);
+      free(p->data.repeat.span);
       break;
 
     case MPC_TYPE_SEPBY1:
@@ -1573,6 +2552,10 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
     case MPC_TYPE_MANY1:
     case MPC_TYPE_COUNT:
       p->data.repeat.x = mpc_copy(a->data.repeat.x);
+      if (a->data.repeat.span) {
+        p->data.repeat.span = malloc(sizeof(mpc_span_t));
+        memcpy(p->data.repeat.span, a->data.repeat.span, sizeof(mpc_span_t));
+      }
       break;
 
     case MPC_TYPE_SEPBY1:
@@ -2938,20 +3921,24 @@ void mpc_ast_delete(mpc_ast_t *a) {
 
   if (a == NULL) { return; }
 
+  if (a->arena) {
+    if (a->arena->root == a) { mpc_ast_arena_delete(a->arena); }
+    return;
+  }
+
   for (i = 0; i < a->children_num; i++) {
     mpc_ast_delete(a->children[i]);
   }
 
   free(a->children);
-  free(a->tag);
   free(a->contents);
   free(a);
 
 }
 
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
+  if (a->arena) { return; }
   free(a->children);
-  free(a->tag);
   free(a->contents);
   free(a);
 }
@@ -2960,8 +3947,7 @@ mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
 
   mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
 
-  a->tag = malloc(strlen(tag) + 1);
-  strcpy(a->tag, tag);
+  a->tag = mpc_ast_intern(tag);
 
   a->contents = malloc(strlen(contents) + 1);
   strcpy(a->contents, contents);
@@ -2970,10 +3956,32 @@ mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
 
   a->children_num = 0;
   a->children = NULL;
+  a->arena = NULL;
   return a;
 
 }
 
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+
+  int i;
+  mpc_ast_t *c;
+
+  if (a == NULL) { return a; }
+
+  c = mpc_ast_new("", a->contents);
+  c->tag = a->tag;
+  c->state = a->state;
+  c->children_num = a->children_num;
+  c->children = a->children_num ? malloc(sizeof(mpc_ast_t*) * a->children_num) : NULL;
+
+  for (i = 0; i < a->children_num; i++) {
+    c->children[i] = mpc_ast_copy(a->children[i]);
+  }
+
+  return c;
+
+}
+
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
 
   mpc_ast_t *a = mpc_ast_new(tag, "");
@@ -3021,32 +4029,35 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
 }
 
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
+  mpc_ast_t **cs;
   r->children_num++;
-  r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
+  if (r->arena) {
+    cs = mpc_ast_arena_bytes(r->arena, sizeof(mpc_ast_t*) * r->children_num);
+    if (r->children_num > 1) {
+      memcpy(cs, r->children, sizeof(mpc_ast_t*) * (r->children_num-1));
+    }
+    r->children = cs;
+  } else {
+    r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
+  }
   r->children[r->children_num-1] = a;
   return r;
 }
 
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
-  memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
-  memmove(a->tag, t, strlen(t));
-  memmove(a->tag + strlen(t), "|", 1);
+  a->tag = mpc_tag_join(MPC_TAG_ADD, t, a->tag);
   return a;
 }
 
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, (strlen(t)-1) + strlen(a->tag) + 1);
-  memmove(a->tag + (strlen(t)-1), a->tag, strlen(a->tag)+1);
-  memmove(a->tag, t, (strlen(t)-1));
+  a->tag = mpc_tag_join(MPC_TAG_ROOT, t, a->tag);
   return a;
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
-  a->tag = realloc(a->tag, strlen(t) + 1);
-  strcpy(a->tag, t);
+  a->tag = mpc_ast_intern(t);
   return a;
 }
 
@@ -3709,6 +4720,7 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
     stmt = *stmts;
     left = mpca_grammar_find_parser(stmt->ident, st);
     if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
+    if (st->flags & MPCA_LANG_PACKRAT) { mpca_packrat(left); }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
     mpc_optimise(stmt->grammar);
     mpc_define(left, stmt->grammar);
@@ -3836,6 +4848,15 @@ mpc_err_t *mpca_lang_pipe(int flags, FILE *p, ...) {
   return err;
 }
 
+/*
+** Marks a rule as `MPCA_LANG_PACKRAT` does, for
+** grammars built without `mpca_lang`.
+*/
+
+void mpca_packrat(mpc_parser_t *p) {
+  p->memo = 1;
+}
+
 mpc_err_t *mpca_lang(int flags, const char *language, ...) {
 
   mpca_grammar_st_t st;
@@ -3948,6 +4969,126 @@ void mpc_stats(mpc_parser_t* p) {
   printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
 }
 
+/*
+** Adds to `s` every character `p` could start
+** consuming input with. Returns zero where this
+** is unknown or `p` could succeed on nothing.
+*/
+static int mpc_span_first(mpc_parser_t *p, mpc_span_t *s) {
+
+  int c, j;
+  char *x;
+
+  if (p->retained) { return 0; }
+
+  switch (p->type) {
+
+    case MPC_TYPE_ANY:
+      for (c = 1; c < 256; c++) { mpc_span_add(s, (char)c); }
+      return 1;
+
+    case MPC_TYPE_SINGLE:
+      mpc_span_add(s, p->data.single.x);
+      return 1;
+
+    case MPC_TYPE_RANGE:
+      for (c = 1; c < 256; c++) {
+        if ((char)c >= p->data.range.x && (char)c <= p->data.range.y) { mpc_span_add(s, (char)c); }
+      }
+      return 1;
+
+    case MPC_TYPE_ONEOF:
+      for (x = p->data.string.x; *x; x++) { mpc_span_add(s, *x); }
+      return 1;
+
+    case MPC_TYPE_NONEOF:
+      for (c = 1; c < 256; c++) {
+        if (!strchr(p->data.string.x, (char)c)) { mpc_span_add(s, (char)c); }
+      }
+      return 1;
+
+    case MPC_TYPE_STRING:
+      if (p->data.string.x[0] == '\0') { return 0; }
+      mpc_span_add(s, p->data.string.x[0]);
+      return 1;
+
+    case MPC_TYPE_EXPECT: return mpc_span_first(p->data.expect.x, s);
+    case MPC_TYPE_APPLY:  return mpc_span_first(p->data.apply.x, s);
+    case MPC_TYPE_MANY1:  return mpc_span_first(p->data.repeat.x, s);
+
+    case MPC_TYPE_AND:
+      if (p->data.and.n == 0) { return 0; }
+      return mpc_span_first(p->data.and.xs[0], s);
+
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) {
+        if (!mpc_span_first(p->data.or.xs[j], s)) { return 0; }
+      }
+      return 1;
+
+    default: return 0;
+  }
+
+}
+
+/*
+** Adds to `s` the characters `p` accepts on its
+** own, consuming exactly that character and
+** returning it as its output. An `or` only
+** counts an alternative's characters where no
+** earlier alternative could have started.
+*/
+static int mpc_span_single(mpc_parser_t *p, mpc_span_t *s) {
+
+  int c, j;
+  mpc_span_t seen, alt;
+
+  if (p->retained) { return 0; }
+
+  switch (p->type) {
+
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      return mpc_span_first(p, s);
+
+    case MPC_TYPE_EXPECT: return mpc_span_single(p->data.expect.x, s);
+
+    case MPC_TYPE_OR:
+      memset(&seen, 0, sizeof(mpc_span_t));
+      for (j = 0; j < p->data.or.n; j++) {
+        memset(&alt, 0, sizeof(mpc_span_t));
+        if (mpc_span_single(p->data.or.xs[j], &alt)) {
+          for (c = 1; c < 256; c++) {
+            if (mpc_span_has(&alt, (char)c) && !mpc_span_has(&seen, (char)c)) { mpc_span_add(s, (char)c); }
+          }
+        }
+        if (!mpc_span_first(p->data.or.xs[j], &seen)) { break; }
+      }
+      return 1;
+
+    default: return 0;
+  }
+
+}
+
+static mpc_span_t *mpc_span_new(mpc_parser_t *p) {
+
+  int c;
+  mpc_span_t *s = calloc(1, sizeof(mpc_span_t));
+
+  if (mpc_span_single(p, s)) {
+    for (c = 1; c < 256; c++) {
+      if (mpc_span_has(s, (char)c)) { mpc_span_mode(s); return s; }
+    }
+  }
+
+  free(s);
+  return NULL;
+}
+
 static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
 
   int i, n, m;
@@ -4115,6 +5256,13 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       continue;
     }
 
+    /* Consume runs of a string `many` in bulk */
+    if ((p->type == MPC_TYPE_MANY || p->type == MPC_TYPE_MANY1)
+    &&  p->data.repeat.f == mpcf_strfold
+    &&  p->data.repeat.span == NULL) {
+      p->data.repeat.span = mpc_span_new(p->data.repeat.x);
+    }
+
     return;
 
   }
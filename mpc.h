@@ -71,6 +71,15 @@ int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+struct mpc_stream_t;
+typedef struct mpc_stream_t mpc_stream_t;
+
+mpc_stream_t *mpc_stream_file(const char *filename, FILE *file);
+mpc_stream_t *mpc_stream_pipe(const char *filename, FILE *pipe);
+int mpc_stream_parse(mpc_stream_t *s, mpc_parser_t *p, mpc_result_t *r);
+int mpc_stream_end(mpc_stream_t *s);
+void mpc_stream_delete(mpc_stream_t *s);
+
 /*
 ** Function Types
 */
@@ -282,15 +291,25 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode);
 ** AST
 */
 
+/*
+** Tags are interned and must not be modified or
+** freed. Nodes built by a parse share an arena
+** which is released when the root is deleted.
+*/
+
 typedef struct mpc_ast_t {
   char *tag;
   char *contents;
   mpc_state_t state;
   int children_num;
   struct mpc_ast_t** children;
+  struct mpc_ast_arena_t *arena;
 } mpc_ast_t;
 
+char *mpc_ast_intern(const char *tag);
+
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents);
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a);
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...);
 mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a);
@@ -355,7 +374,8 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_PACKRAT              = 4
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
@@ -365,6 +385,8 @@ mpc_err_t *mpca_lang_file(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_pipe(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...);
 
+void mpca_packrat(mpc_parser_t *p);
+
 /*
 ** Misc
 */